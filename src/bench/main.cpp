@@ -0,0 +1,1742 @@
+// Host checks and benchmarks, build and run with `pio run -e bench` and
+// `.pio/build/bench/program <mode>`.
+//
+// Every mode checks the protocol code of src/protocoll against a plain
+// reference first and exits with 1 on the first difference, then times it:
+//
+//   routes   routing trie against a linear scan of the connections
+//   cache    cached next hops of Node::routeBatch against uncached ones
+//   storage  Address with inline storage against a std::vector of elements
+//   forward  heap allocations and copies of a pocket forwarded by
+//            receivePocket, which have to be none
+//   compare  commonPrefix of arrays and addresses against an element by
+//            element loop
+//   frames   data frames of every version and bundles encoded and decoded
+//            into pool requests
+//   crc      table CRCs against bitwise ones, errors v3 (Fletcher) and v4
+//            (CRC) frames miss
+//   duplicates  DuplicateFilter against a map of every pocket seen
+//   addresses  varint address encoding against v1, reserved hello
+//            elements and connect requests of the deepest nodes
+//   fec      frames with error correction through single bits, bursts of
+//            two and random bit errors
+//   multipath [pockets] [multipath 0|1]
+//            simulated diamond [1,3] - [1,1] | [1,2] - [1,4], both paths
+//            to [1,4] cost the same, [1,3] sends it `pockets` pockets
+//   hello    simulated star, the hub negotiates with four children at once,
+//            each pair with other rates, line codes and error correction
+//   early    simulated pockets longer than a v1 frame, sent before the hello
+//            and over a connection that stays at v1
+//   misread [pockets]
+//            simulated connection whose ends settled on different versions
+//   hub [pockets]
+//            simulated star, [1] sends `pockets` pockets to each of 2, 4
+//            and 8 children at once, for the aggregate throughput
+//   chain [pockets] [cut-through 0|1]
+//            simulated chain [1] - [1,1] - ... - [1,1,1,1,1,1,1], the
+//            deepest node sends `pockets` single pockets six hops up to
+//            [1], one after the other, for their latency
+//   jitter [pockets] [drift ppm] [jitter us]
+//            simulated chain [1] - [1,1] - [1,1,1] on Manchester, the
+//            clocks of [1,1] and [1,1,1] drift apart, every board has timer
+//            jitter, [1,1,1] sends `pockets` pockets to [1], none may be lost
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <map>
+#include <vector>
+#include <initializer_list>
+#include <new>
+
+// the simulated nodes share one pocket pool
+#define POCKET_POOL_SIZE 256
+
+// Pocket::copies() counts every copy, see forward
+#define POCKET_COUNT_COPIES
+
+#define BENCH_NEGOTIATE_TIMEOUT_S 120
+#define BENCH_TIMEOUT_PER_POCKET_S 120
+
+#include "../hal/index.hpp"
+#include "../protocoll/index.hpp"
+
+typedef std::chrono::steady_clock Clock;
+
+// Every heap allocation of the program, see forward. glibc lets a program
+// replace malloc (new of libstdc++ ends there too), elsewhere only new counts.
+static std::atomic<size_t> heapAllocations{0};
+
+#if defined(__GLIBC__)
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t count, size_t size);
+extern "C" void *__libc_realloc(void *pointer, size_t size);
+
+extern "C" void *malloc(size_t size) noexcept
+{
+  heapAllocations++;
+  return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t count, size_t size) noexcept
+{
+  heapAllocations++;
+  return __libc_calloc(count, size);
+}
+
+extern "C" void *realloc(void *pointer, size_t size) noexcept
+{
+  heapAllocations++;
+  return __libc_realloc(pointer, size);
+}
+#else
+void *operator new(size_t size)
+{
+  heapAllocations++;
+  void *pointer = malloc(size);
+  if (pointer == nullptr)
+    throw std::bad_alloc();
+  return pointer;
+}
+#endif
+
+static double nsPer(Clock::time_point start, size_t count)
+{
+  return std::chrono::duration<double, std::nano>(Clock::now() - start).count() / count;
+}
+
+static Address randomAddress(std::mt19937 &random, size_t maxDepth, uint16_t parts)
+{
+  Address address;
+  size_t depth = random() % (maxDepth + 1);
+  for (size_t i = 0; i < depth; i++)
+    address.push_back(1 + random() % parts);
+  return address;
+}
+
+// The linear scan the trie replaced: the best matchIndex wins, equal scores
+// go to the longer address, the first connection on equal score and length.
+// Unlike the scan in the first version of Node::send it compares against the
+// length of the current best, that one kept the length of the last
+// connection that won a tie, so after a better score it could still let a
+// shorter address win (the trie does not reproduce that).
+static size_t scanRoute(const vector<Connection> &connections, const Address &destination, int &score)
+{
+  size_t best = 0;
+  score = matchIndex(match(connections[0].address, destination));
+  for (size_t i = 1; i < connections.size(); i++)
+  {
+    int current = matchIndex(match(connections[i].address, destination));
+    if (current > score || (current == score && connections[i].address.size() > connections[best].address.size()))
+    {
+      best = i;
+      score = current;
+    }
+  }
+  return best;
+}
+
+static int routes()
+{
+  std::mt19937 random(1);
+
+  for (int table = 0; table < 20000; table++)
+  {
+    vector<Connection> connections;
+    size_t count = 1 + random() % 20;
+    for (size_t i = 0; i < count; i++)
+      connections.push_back(Connection{randomAddress(random, 4, 3), (uint8_t)i});
+
+    RoutingTable routes;
+    routes.build(connections);
+
+    for (int k = 0; k < 20; k++)
+    {
+      Address destination = randomAddress(random, 4, 3);
+      int expectedScore;
+      size_t expected = scanRoute(connections, destination, expectedScore);
+
+      // every connection that ties with the scan's choice, up to the limit
+      size_t ties = 0;
+      for (const Connection &c : connections)
+      {
+        if (matchIndex(match(c.address, destination)) == expectedScore &&
+            c.address.size() == connections[expected].address.size())
+          ties++;
+      }
+
+      uint16_t paths[MULTIPATH_MAX_PATHS];
+      int score = 0;
+      size_t found = routes.lookup(destination, paths, &score);
+      if (found == 0 || paths[0] != expected || score != expectedScore || found != min<size_t>(ties, MULTIPATH_MAX_PATHS))
+      {
+        printf("[Bench] routes: table %d picks %u (score %d, %u paths), the scan %u (score %d, %u ties)\n", table,
+               found ? paths[0] : 0, score, (unsigned)found, (unsigned)expected, expectedScore, (unsigned)ties);
+        return 1;
+      }
+    }
+  }
+  printf("[Bench] routes: trie and scan agree on 400000 lookups\n");
+
+  for (size_t count : {4, 16, 64, 256, 1024})
+  {
+    vector<Connection> connections;
+    for (size_t i = 0; i < count; i++)
+      connections.push_back(Connection{randomAddress(random, 8, 4), (uint8_t)(i % 250 + 2)});
+    RoutingTable routes;
+    routes.build(connections);
+
+    vector<Address> destinations;
+    for (int i = 0; i < 1024; i++)
+      destinations.push_back(randomAddress(random, 8, 4));
+
+    const size_t lookups = 2000000 / count + 100000;
+    volatile size_t sink = 0;
+    uint16_t paths[MULTIPATH_MAX_PATHS];
+    int score;
+
+    Clock::time_point start = Clock::now();
+    for (size_t i = 0; i < lookups; i++)
+    {
+      routes.lookup(destinations[i % destinations.size()], paths, &score);
+      sink = sink + paths[0];
+    }
+    double trie = nsPer(start, lookups);
+
+    start = Clock::now();
+    for (size_t i = 0; i < lookups; i++)
+      sink = sink + scanRoute(connections, destinations[i % destinations.size()], score);
+    double scan = nsPer(start, lookups);
+
+    printf("[Bench] routes: %4u connections, %7.1f ns per trie lookup, %8.1f ns per scan\n", (unsigned)count, trie,
+           scan);
+  }
+  return 0;
+}
+
+static int cache()
+{
+  std::mt19937 random(2);
+  Node node;
+  vector<Connection> connections;
+  for (uint8_t i = 0; i < 8; i++)
+    connections.push_back(Connection{randomAddress(random, 3, 3), (uint8_t)(i + 2)});
+  node.setConnections(connections, randomAddress(random, 3, 3));
+
+  // the cache has to follow every swap of the connections
+  for (int k = 0; k < 100000; k++)
+  {
+    if (k % 1000 == 0)
+    {
+      vector<Connection> next = node.connections;
+      next[random() % next.size()].address = randomAddress(random, 3, 3);
+      node.setConnections(next, randomAddress(random, 3, 3));
+    }
+
+    Pocket p(randomAddress(random, 3, 3), "x");
+    p.id = random();
+    uint8_t cached = node.send(p);
+    uint8_t uncached = node.choosePin(node.route(p.address), RouteCache::hash(p.address), p.id);
+    if (cached != uncached)
+    {
+      printf("[Bench] cache: pocket %d goes to pin %u, uncached to pin %u\n", k, cached, uncached);
+      return 1;
+    }
+  }
+  printf("[Bench] cache: cached and uncached agree on 100000 pockets, %u hits, %u misses\n", node.cache.hits,
+         node.cache.misses);
+
+  connections.clear();
+  for (size_t i = 0; i < 64; i++)
+    connections.push_back(Connection{randomAddress(random, 8, 4), (uint8_t)(i + 2)});
+  node.setConnections(connections, randomAddress(random, 8, 4));
+
+  // pockets to 16 destinations, in runs of `run` to the same one
+  for (size_t run : {1, 8})
+  {
+    vector<Pocket> pockets;
+    vector<Address> destinations;
+    for (int i = 0; i < 16; i++)
+      destinations.push_back(randomAddress(random, 8, 4));
+    for (size_t i = 0; i < 4096; i++)
+      pockets.push_back(Pocket(destinations[i / run % destinations.size()], "x"));
+
+    const size_t rounds = 200;
+    uint8_t pins[4096];
+    volatile size_t sink = 0;
+
+    Clock::time_point start = Clock::now();
+    for (size_t r = 0; r < rounds; r++)
+    {
+      node.routeBatch(pockets.data(), pockets.size(), pins);
+      sink = sink + pins[r];
+    }
+    double batch = nsPer(start, rounds * pockets.size());
+
+    start = Clock::now();
+    for (size_t r = 0; r < rounds; r++)
+    {
+      for (const Pocket &p : pockets)
+        sink = sink + node.choosePin(node.route(p.address), RouteCache::hash(p.address), p.id);
+    }
+    double uncached = nsPer(start, rounds * pockets.size());
+
+    printf("[Bench] cache: runs of %u, %6.1f ns per pocket in routeBatch, %6.1f ns uncached\n", (unsigned)run, batch,
+           uncached);
+  }
+  return 0;
+}
+
+static int storage()
+{
+  // refused past ADDRESS_MAX_DEPTH, everything before kept
+  Address full;
+  for (uint16_t i = 1; i <= ADDRESS_MAX_DEPTH; i++)
+    full.push_back(i);
+  Address copy = full;
+  if (copy.push_back(1) || copy.size() != ADDRESS_MAX_DEPTH || !eq(copy, full) || copy[ADDRESS_MAX_DEPTH - 1] != ADDRESS_MAX_DEPTH)
+  {
+    printf("[Bench] storage: an address took more than %u elements\n", ADDRESS_MAX_DEPTH);
+    return 1;
+  }
+  printf("[Bench] storage: elements past %u are refused\n", ADDRESS_MAX_DEPTH);
+
+  // built, copied into a pocket and compared, as every received pocket is
+  for (size_t depth : {1, 4, 16})
+  {
+    const size_t rounds = 2000000;
+    volatile size_t sink = 0;
+
+    Clock::time_point start = Clock::now();
+    for (size_t r = 0; r < rounds; r++)
+    {
+      Address address;
+      for (size_t i = 0; i < depth; i++)
+        address.push_back(r + i);
+      Address copy = address;
+      sink = sink + eq(copy, address);
+    }
+    double inlined = nsPer(start, rounds);
+
+    start = Clock::now();
+    for (size_t r = 0; r < rounds; r++)
+    {
+      std::vector<uint16_t> address;
+      for (size_t i = 0; i < depth; i++)
+        address.push_back(r + i);
+      std::vector<uint16_t> copy = address;
+      sink = sink + (copy == address);
+    }
+    double heap = nsPer(start, rounds);
+
+    printf("[Bench] storage: depth %2u, %5.1f ns inline, %5.1f ns std::vector\n", (unsigned)depth, inlined, heap);
+  }
+  return 0;
+}
+
+static size_t plainPrefix(const uint16_t *a, const uint16_t *b, size_t n)
+{
+  size_t i = 0;
+  while (i < n && a[i] == b[i])
+    i++;
+  return i;
+}
+
+static int compare()
+{
+  std::mt19937 random(3);
+
+  // longer than any address, so every step width is covered
+  for (int t = 0; t < 2000000; t++)
+  {
+    uint16_t a[64], b[64];
+    size_t n = random() % 65;
+    for (size_t i = 0; i < n; i++)
+    {
+      a[i] = random() % 3;
+      b[i] = random() % 4 == 0 ? random() % 3 : a[i];
+    }
+    if (commonPrefix(a, b, n) != plainPrefix(a, b, n))
+    {
+      printf("[Bench] compare: %u elements, commonPrefix %u, the loop %u\n", (unsigned)n,
+             (unsigned)commonPrefix(a, b, n), (unsigned)plainPrefix(a, b, n));
+      return 1;
+    }
+  }
+
+  // the masked compare of whole addresses, padding past n must not count
+  for (int t = 0; t < 2000000; t++)
+  {
+    Address a = randomAddress(random, ADDRESS_MAX_DEPTH, 3), b = a;
+    for (size_t i = 0; i < b.size(); i++)
+    {
+      if (random() % 4 == 0)
+        b[i] = 1 + random() % 3;
+    }
+    size_t n = a.empty() ? 0 : random() % (a.size() + 1);
+    if (commonPrefix(a, b, n) != plainPrefix(a.begin(), b.begin(), n))
+    {
+      printf("[Bench] compare: %u of %u elements, commonPrefix of the addresses %u, the loop %u\n", (unsigned)n,
+             (unsigned)a.size(), (unsigned)commonPrefix(a, b, n), (unsigned)plainPrefix(a.begin(), b.begin(), n));
+      return 1;
+    }
+  }
+  printf("[Bench] compare: commonPrefix and the loop agree on 2000000 pairs of arrays and of addresses\n");
+
+  // equal addresses, the worst case of the match in every routing decision
+  for (size_t depth = 1; depth <= ADDRESS_MAX_DEPTH; depth++)
+  {
+    Address a, b;
+    for (size_t i = 0; i < depth; i++)
+    {
+      a.push_back(1 + random() % 4);
+      b.push_back(a[i]);
+    }
+
+    const size_t compares = 20000000;
+    volatile size_t sink = 0;
+    const uint16_t *volatile pa = a.begin();
+    const uint16_t *volatile pb = b.begin();
+    const Address *volatile aa = &a;
+    const Address *volatile ab = &b;
+
+    Clock::time_point start = Clock::now();
+    for (size_t i = 0; i < compares; i++)
+      sink = sink + commonPrefix(*aa, *ab, depth);
+    double masked = nsPer(start, compares);
+
+    start = Clock::now();
+    for (size_t i = 0; i < compares; i++)
+      sink = sink + commonPrefix(pa, pb, depth);
+    double fast = nsPer(start, compares);
+
+    start = Clock::now();
+    for (size_t i = 0; i < compares; i++)
+      sink = sink + plainPrefix(pa, pb, depth);
+    double plain = nsPer(start, compares);
+
+    printf("[Bench] compare: depth %2u, %5.2f ns addresses, %5.2f ns arrays, %5.2f ns the loop\n", (unsigned)depth,
+           masked, fast, plain);
+  }
+  return 0;
+}
+
+// a pocket frameEncodable in version
+static Pocket randomPocket(std::mt19937 &random, uint8_t version)
+{
+  static const uint16_t parts[] = {1, 2, 3, 0x7F, 0x80, 0x3FFF, 0x4000, FRAME_HELLO_MARKER - 1};
+  Address address;
+  size_t depth = random() % (ADDRESS_MAX_DEPTH + 1);
+  for (size_t i = 0; i < depth; i++)
+    address.push_back(random() % 2 ? parts[random() % 8] : 1 + random() % (FRAME_HELLO_MARKER - 1));
+
+  char data[DATASIZE];
+  size_t length = random() % ((version < FRAME_VERSION_3 ? FRAME_FIXED_DATASIZE : DATASIZE) + 1);
+  for (size_t i = 0; i < length; i++)
+    data[i] = random();
+
+  Pocket p(address, data, length);
+  p.id = random();
+  if (version >= FRAME_VERSION_3 && random() % 4 == 0)
+  {
+    p.fragments = 2 + random() % 200;
+    p.fragment = random() % p.fragments;
+  }
+  return p;
+}
+
+// feeds the bits after the start bit to frame, true if they made up exactly
+// one complete frame
+static bool decodeFrame(const FrameBits &bits, FrameDecoder &frame, Pocket *target, uint8_t version)
+{
+  frame.begin(target, version);
+  for (size_t i = 1; i < bits.count; i++)
+  {
+    if (frame.pushBit(bits[i]))
+      return i + 1 == bits.count;
+  }
+  return false;
+}
+
+// what p arrives as, v1 and v2 pad the data with spaces
+static bool sameAsSent(const Pocket &sent, const Pocket &received, uint8_t version)
+{
+  Pocket expected = sent;
+  if (version < FRAME_VERSION_3)
+  {
+    memset(expected.data + sent.length, ' ', FRAME_FIXED_DATASIZE - sent.length);
+    expected.length = FRAME_FIXED_DATASIZE;
+  }
+  return eq(expected.address, received.address) && expected.length == received.length &&
+         memcmp(expected.data, received.data, expected.length) == 0 && expected.id == received.id &&
+         expected.fragmented() == received.fragmented() &&
+         (!expected.fragmented() || (expected.fragment == received.fragment && expected.fragments == received.fragments));
+}
+
+// A pocket for [1,1,1] arrives at [1,1] from [1] and is forwarded, in
+// every frame version: decoded into a request of the pool, checked, routed
+// and queued by receivePocket, then encoded for the next hop as
+// sendNormalPocket does. None of it may touch the heap or copy the pocket.
+static int forward()
+{
+  hal::sim::Board board("[1,1]");
+  hal::sim::BoardScope scope(board);
+  static PhysikalNode node;
+
+  Address parent, child;
+  parent.push_back(1);
+  child.push_back(1);
+  child.push_back(1);
+  child.push_back(1);
+  node.logicalNode.you.push_back(1);
+  node.logicalNode.you.push_back(1);
+  node.logicalNode.connections.push_back(Connection{parent, 2});
+  node.logicalNode.connections.push_back(Connection{child, 3});
+  node.logicalNode.updateRoutes();
+  node.syncPorts();
+  node.running = true; // no task, receivePocket runs right here
+
+  // the counter has to see an allocation through new
+  void *(*volatile allocate)(size_t) = ::operator new;
+  size_t probe = heapAllocations;
+  ::operator delete(allocate(sizeof(Pocket)));
+  if (heapAllocations == probe)
+  {
+    printf("[Bench] forward: heap allocations are not counted\n");
+    return 1;
+  }
+
+  PinPort &in = *node.portOn(2), &out = *node.portOn(3);
+  FrameBits bits;
+  FrameDecoder frame;
+  const size_t pockets = 100000;
+  int failed = 0;
+
+  for (uint8_t version = FRAME_VERSION_1; version <= FRAME_VERSION_MAX; version++)
+  {
+    for (Connection &c : node.logicalNode.connections)
+    {
+      c.version = version;
+      c.helloLeft = 0;
+    }
+
+    size_t allocations = 0, copies = 0, forwarded = 0;
+    Clock::time_point start;
+
+    // the first pocket is not counted, it may set up statics on its way
+    for (size_t i = 0; i <= pockets; i++)
+    {
+      if (i == 1)
+      {
+        allocations = heapAllocations;
+        copies = Pocket::copies();
+        start = Clock::now();
+      }
+
+      Pocket p(child, "forwarded 0123");
+      p.id = i + 1;
+      encodeFrame(p, version, bits);
+
+      SendRequest *req = new (POOL_RECEIVE) SendRequest();
+      decodeFrame(bits, frame, &req->pocket, version);
+      node.receivePocket(in, req, frame);
+      in.acks.pendingCount = 0;
+
+      node.portsLock.lock();
+      SendRequest *queued = out.queue.pop();
+      node.portsLock.unlock();
+      if (queued == nullptr)
+        continue;
+      encodeFrame(queued->pocket, version, out.tx.frame);
+      node.backlogDone(out.pin());
+      delete queued;
+      forwarded += i > 0;
+    }
+    double ns = nsPer(start, pockets);
+    allocations = heapAllocations - allocations;
+    copies = Pocket::copies() - copies;
+
+    printf("[Bench] forward: v%u, %u/%u pockets forwarded, %u heap allocations, %u pocket copies, %.1f ns per "
+           "pocket\n",
+           version, (unsigned)forwarded, (unsigned)pockets, (unsigned)allocations, (unsigned)copies, ns);
+    if (forwarded != pockets || allocations != 0 || copies != 0)
+      failed = 1;
+  }
+  node.running = false;
+  return failed;
+}
+
+static int frames()
+{
+  std::mt19937 random(4);
+  size_t poolBefore = pocketPool().available();
+
+  for (uint8_t version = FRAME_VERSION_1; version <= FRAME_VERSION_MAX; version++)
+  {
+    for (int t = 0; t < 100000; t++)
+    {
+      Pocket p = randomPocket(random, version);
+      FrameBits bits;
+      encodeFrame(p, version, bits);
+
+      // decoded straight into a request of the pool, as the receivers do
+      SendRequest *req = new (POOL_RECEIVE) SendRequest();
+      FrameDecoder frame;
+      bool ok = decodeFrame(bits, frame, &req->pocket, version) && frame.checksumOk() &&
+                !frame.tooDeep && !frame.tooLong && bits.count == frameBits(p, version) &&
+                sameAsSent(p, req->pocket, version);
+      delete req;
+      if (!ok)
+      {
+        printf("[Bench] frames: v%u pocket %d of %u elements and %u bytes did not come back\n", version, t,
+               (unsigned)p.address.size(), p.length);
+        return 1;
+      }
+    }
+  }
+
+  if (pocketPool().available() != poolBefore)
+  {
+    printf("[Bench] frames: %u pool blocks leaked\n", (unsigned)(poolBefore - pocketPool().available()));
+    return 1;
+  }
+  printf("[Bench] frames: 100000 pockets per version from v1 to v%u came back\n", FRAME_VERSION_MAX);
+
+  // bundles as gatherBundle puts them together, every other pocket to the
+  // address of the one before
+  size_t bundled = 0;
+  for (int t = 0; t < 50000; t++)
+  {
+    Pocket pockets[FRAME_BUNDLE_MAX];
+    const Pocket *order[FRAME_BUNDLE_MAX];
+    uint8_t count = 0;
+    size_t expectedBits = FRAME_BUNDLE_BITS;
+    while (count < FRAME_BUNDLE_MAX)
+    {
+      Pocket p = randomPocket(random, FRAME_VERSION_5);
+      bool sameAddress = count > 0 && random() % 2;
+      if (sameAddress)
+        p.address = pockets[count - 1].address;
+      size_t more = bundledBits(p, sameAddress || (count > 0 && eq(p.address, pockets[count - 1].address)));
+      if (count > 0 && expectedBits + more > FRAME_MAX_BITS)
+        break;
+      expectedBits += more;
+      pockets[count] = p;
+      order[count] = &pockets[count];
+      count++;
+    }
+
+    FrameBits bits;
+    encodeBundle(order, count, bits);
+
+    Pocket received[FRAME_BUNDLE_MAX];
+    FrameDecoder frame;
+    frame.begin(&received[0], FRAME_VERSION_5);
+    uint8_t done = 0;
+    bool ok = bits.count == expectedBits;
+    for (size_t i = 1; i < bits.count && ok; i++)
+    {
+      if (!frame.pushBit(bits[i]))
+        continue;
+      ok = frame.bundle && frame.checksumOk() && sameAsSent(pockets[done], received[done], FRAME_VERSION_5);
+      done++;
+      if (frame.more() && done < count)
+        frame.next(&received[done]);
+      else
+        ok = ok && !frame.more() && done == count && i + 1 == bits.count;
+    }
+    if (!ok || done != count)
+    {
+      printf("[Bench] frames: bundle %d of %u pockets came back with %u\n", t, count, done);
+      return 1;
+    }
+    bundled += count;
+  }
+  printf("[Bench] frames: 50000 bundles of %u pockets in all came back\n", (unsigned)bundled);
+
+  for (uint8_t version = FRAME_VERSION_1; version <= FRAME_VERSION_MAX; version++)
+  {
+    vector<Pocket> pockets;
+    for (int i = 0; i < 256; i++)
+      pockets.push_back(randomPocket(random, version));
+
+    const size_t rounds = 400;
+    FrameBits bits;
+    volatile size_t sink = 0;
+
+    Clock::time_point start = Clock::now();
+    for (size_t r = 0; r < rounds; r++)
+    {
+      for (const Pocket &p : pockets)
+      {
+        encodeFrame(p, version, bits);
+        sink = sink + bits.count;
+      }
+    }
+    double encode = nsPer(start, rounds * pockets.size());
+
+    vector<FrameBits> encoded(pockets.size());
+    for (size_t i = 0; i < pockets.size(); i++)
+      encodeFrame(pockets[i], version, encoded[i]);
+
+    Pocket target;
+    FrameDecoder frame;
+    start = Clock::now();
+    for (size_t r = 0; r < rounds; r++)
+    {
+      for (const FrameBits &b : encoded)
+        sink = sink + decodeFrame(b, frame, &target, version);
+    }
+    double decode = nsPer(start, rounds * pockets.size());
+
+    printf("[Bench] frames: v%u, %6.1f ns to encode, %6.1f ns to decode a pocket\n", version, encode, decode);
+  }
+  return 0;
+}
+
+static uint32_t bitwiseCrc(uint8_t kind, const uint8_t *data, size_t length)
+{
+  if (kind == CRC_16)
+  {
+    uint16_t crc = CRC16_INIT;
+    for (size_t i = 0; i < length; i++)
+    {
+      crc ^= data[i] << 8;
+      for (int k = 0; k < 8; k++)
+        crc = crc & 0x8000 ? crc << 1 ^ 0x1021 : crc << 1;
+    }
+    return crc;
+  }
+  uint32_t crc = CRC32_INIT;
+  for (size_t i = 0; i < length; i++)
+  {
+    crc ^= data[i];
+    for (int k = 0; k < 8; k++)
+      crc = crc & 1 ? crc >> 1 ^ 0xEDB88320 : crc >> 1;
+  }
+  return ~crc;
+}
+
+static uint32_t tableCrc(uint8_t kind, const uint8_t *data, size_t length)
+{
+  FrameCrc crc;
+  crc.begin(kind);
+  for (size_t i = 0; i < length; i++)
+    crc.update(data[i]);
+  return crc.value();
+}
+
+static int crcs()
+{
+  std::mt19937 random(5);
+
+  const uint8_t check[] = {'1', '2', '3', '4', '5', '6', '7', '8', '9'};
+  if (tableCrc(CRC_16, check, 9) != 0x29B1 || tableCrc(CRC_32, check, 9) != 0xCBF43926)
+  {
+    printf("[Bench] crc: wrong check values %04X %08X\n", (unsigned)tableCrc(CRC_16, check, 9),
+           (unsigned)tableCrc(CRC_32, check, 9));
+    return 1;
+  }
+  for (int t = 0; t < 100000; t++)
+  {
+    uint8_t data[64];
+    size_t length = random() % 65;
+    for (size_t i = 0; i < length; i++)
+      data[i] = random();
+    for (uint8_t kind : {CRC_16, CRC_32})
+    {
+      if (tableCrc(kind, data, length) != bitwiseCrc(kind, data, length))
+      {
+        printf("[Bench] crc: table and bitwise CRC differ on %u bytes\n", (unsigned)length);
+        return 1;
+      }
+    }
+  }
+  printf("[Bench] crc: check values match, table and bitwise CRCs agree on 100000 inputs\n");
+
+  // corrupted frames that still decode with a valid checksum but other content
+  static const char *errors[] = {"1 bit", "2 bits", "3 bits", "burst <= 16", "burst 17-32"};
+  Address address;
+  address.push_back(1);
+  address.push_back(300);
+  address.push_back(7);
+  for (uint8_t version : {FRAME_VERSION_3, FRAME_VERSION_4})
+  {
+    for (size_t length : {8, 32})
+    {
+      for (int error = 0; error < 5; error++)
+      {
+        const int trials = 50000;
+        int decoded = 0, missed = 0;
+        for (int t = 0; t < trials; t++)
+        {
+          char data[DATASIZE];
+          for (size_t i = 0; i < length; i++)
+            data[i] = random();
+          Pocket p(address, data, length);
+          p.id = random();
+          FrameBits bits;
+          encodeFrame(p, version, bits);
+
+          // after start, type and header bit, so the frame stays a data frame
+          int first = 10, n = bits.count;
+          auto flip = [&](int i) { bits.bytes[i / 8] ^= 0x80 >> (i % 8); };
+          if (error < 3)
+          {
+            for (int f = 0; f <= error; f++)
+              flip(first + random() % (n - first));
+          }
+          else
+          {
+            int burst = error == 3 ? 2 + random() % 15 : 17 + random() % 16;
+            int at = first + random() % (n - first - burst);
+            flip(at);
+            flip(at + burst - 1);
+            for (int i = at + 1; i < at + burst - 1; i++)
+            {
+              if (random() & 1)
+                flip(i);
+            }
+          }
+
+          Pocket received;
+          FrameDecoder frame;
+          if (!decodeFrame(bits, frame, &received, version) || !frame.knownVersion || frame.tooLong)
+            continue;
+          decoded++;
+          if (frame.checksumOk() && !sameAsSent(p, received, version))
+            missed++;
+        }
+        printf("[Bench] crc: v%u, %2u byte payload, %-11s missed %5d of %d\n", version, (unsigned)length,
+               errors[error], missed, decoded);
+        if (version >= FRAME_VERSION_4 && error != 4 && missed > 0)
+          return 1;
+      }
+    }
+  }
+
+  uint8_t data[DATASIZE];
+  for (uint8_t &b : data)
+    b = random();
+  Pocket p(address, (const char *)data, DATASIZE);
+  const size_t rounds = 1000000;
+  volatile uint32_t sink = 0;
+
+  Clock::time_point start = Clock::now();
+  for (size_t r = 0; r < rounds; r++)
+  {
+    p.data[0] = r;
+    sink = sink + p.calculateChecksum();
+  }
+  double fletcher = nsPer(start, rounds);
+
+  double table[3];
+  for (uint8_t kind : {CRC_16, CRC_32})
+  {
+    start = Clock::now();
+    for (size_t r = 0; r < rounds; r++)
+    {
+      data[0] = r;
+      sink = sink + tableCrc(kind, data, DATASIZE);
+    }
+    table[kind] = nsPer(start, rounds);
+  }
+  printf("[Bench] crc: %u bytes in %.1f ns Fletcher, %.1f ns CRC-16, %.1f ns CRC-32\n", DATASIZE, fletcher,
+         table[CRC_16], table[CRC_32]);
+  return 0;
+}
+
+static int duplicates()
+{
+  std::mt19937 random(6);
+  Address address;
+  address.push_back(1);
+  address.push_back(2);
+
+  // a retransmission storm: 40 pockets, each one arriving 20 times
+  DuplicateFilter storm;
+  vector<uint16_t> ids;
+  for (int i = 0; i < 40; i++)
+    ids.push_back(random());
+  int fresh = 0;
+  for (int r = 0; r < 20; r++)
+  {
+    for (uint16_t id : ids)
+      fresh += !storm.seen(address, id, 1000 + r);
+  }
+  int again = 0;
+  for (uint16_t id : ids)
+    again += !storm.seen(address, id, 1000 + DUPLICATE_EXPIRY_MS + 100);
+  if (fresh != 40 || storm.duplicates != 40 * 19 || again != 40)
+  {
+    printf("[Bench] duplicates: storm let %d of 40 through, %d after expiry\n", fresh, again);
+    return 1;
+  }
+
+  // more pockets than fit, never a false duplicate, the latest ones are known
+  DuplicateFilter flood;
+  int falseDuplicates = 0, known = 0;
+  for (int i = 0; i < 10000; i++)
+    falseDuplicates += flood.seen(address, i, 5000);
+  for (int i = 10000 - DUPLICATE_CAPACITY / 4; i < 10000; i++)
+    known += flood.seen(address, i, 5001);
+  if (falseDuplicates > 0 || known != DUPLICATE_CAPACITY / 4 || flood.count > DUPLICATE_CAPACITY)
+  {
+    printf("[Bench] duplicates: flood gave %d false duplicates, knew %d of the last %d\n", falseDuplicates, known,
+           DUPLICATE_CAPACITY / 4);
+    return 1;
+  }
+
+  // a copy that isn't remembered is new again next time
+  DuplicateFilter refused;
+  if (refused.seen(address, 7, 0, false) || refused.seen(address, 7, 1) || !refused.seen(address, 7, 2))
+  {
+    printf("[Bench] duplicates: a pocket that was not remembered came back as a duplicate\n");
+    return 1;
+  }
+  printf("[Bench] duplicates: storm, flood, expiry and refused pockets as expected\n");
+
+  // steady traffic from three senders against a model that remembers every
+  // pocket let through: a duplicate is never reported wrongly, only an
+  // evicted one can be missed, none while all of them fit
+  for (uint16_t ids : {12, 300})
+  {
+    DuplicateFilter steady;
+    std::map<uint32_t, uint32_t> model;
+    int wrong = 0, missed = 0;
+    for (int t = 0; t < 200000; t++)
+    {
+      uint32_t now = t * 5;
+      uint16_t id = random() % ids;
+      Address from;
+      from.push_back(1 + random() % 3);
+      bool duplicate = steady.seen(from, id, now);
+
+      uint32_t key = from[0] << 16 | id;
+      auto it = model.find(key);
+      bool expected = it != model.end() && now - it->second <= DUPLICATE_EXPIRY_MS;
+      if (!duplicate)
+        model[key] = now;
+      wrong += duplicate && !expected;
+      missed += expected && !duplicate;
+    }
+    printf("[Bench] duplicates: %3u ids per sender, %d wrong, %6d missed, %6u evicted\n", ids, wrong, missed,
+           (unsigned)steady.evicted);
+    if (wrong > 0 || (3 * ids <= DUPLICATE_CAPACITY * 3 / 4 && missed > 0))
+      return 1;
+  }
+
+  DuplicateFilter lookups;
+  const size_t n = 5000000;
+  volatile int sink = 0;
+  Clock::time_point start = Clock::now();
+  for (size_t i = 0; i < n; i++)
+    sink = sink + lookups.seen(address, i % 40, i / 1000);
+  printf("[Bench] duplicates: %.1f ns per lookup\n", nsPer(start, n));
+  return 0;
+}
+
+// a connect request of address followed by extra elements, as startHello
+// sends it, decoded like a management frame
+static bool decodeConnectRequest(const Address &address, std::initializer_list<uint16_t> extra, FrameDecoder &frame,
+                                 Pocket *target)
+{
+  FrameBits bits = FrameBits();
+  bits.push(1); // start
+  bits.push(0); // management frame
+  bits.push(1); // connect request
+  for (uint16_t part : address)
+    bits.pushUInt16(part);
+  for (uint16_t part : extra)
+    bits.pushUInt16(part);
+  bits.pushUInt16(0);
+  return decodeFrame(bits, frame, target, FRAME_VERSION_1) && frame.connectRequest;
+}
+
+static int addresses()
+{
+  // elements from FRAME_HELLO_MARKER on only ever end a hello
+  Address reserved;
+  reserved.push_back(1);
+  reserved.push_back(FRAME_HELLO_MARKER);
+  for (uint8_t version = FRAME_VERSION_1; version <= FRAME_VERSION_MAX; version++)
+  {
+    if (frameEncodable(Pocket(reserved, "x"), version))
+    {
+      printf("[Bench] addresses: v%u encodes a reserved element\n", version);
+      return 1;
+    }
+  }
+
+  // the deepest node says hello with offer and marker past its address
+  Address deepest;
+  while (!deepest.full())
+    deepest.push_back(FRAME_HELLO_MARKER - 1);
+  FrameDecoder frame;
+  Pocket target;
+  uint16_t offer = FRAME_HELLO_OFFER | LINE_CODE_MANCHESTER << 8 | 3;
+  uint16_t marker = FRAME_HELLO_MARKER | FRAME_HELLO_FEC | FRAME_VERSION_MAX;
+  if (!decodeConnectRequest(deepest, {offer, marker}, frame, &target) || frame.tooDeep || frame.overflowCount != 2 ||
+      frame.overflow[0] != offer || frame.overflow[1] != marker || !eq(target.address, deepest))
+  {
+    printf("[Bench] addresses: the hello of a node %u deep did not come through\n", ADDRESS_MAX_DEPTH);
+    return 1;
+  }
+  if (!decodeConnectRequest(deepest, {1, offer, marker}, frame, &target) || !frame.tooDeep)
+  {
+    printf("[Bench] addresses: a hello one element too deep was taken\n");
+    return 1;
+  }
+  printf("[Bench] addresses: reserved elements are refused, hellos of %u deep nodes come through\n",
+         ADDRESS_MAX_DEPTH);
+
+  // wire bits of the address part, small elements as most trees have them
+  for (size_t depth = 1; depth <= ADDRESS_MAX_DEPTH; depth *= 2)
+  {
+    Address address;
+    for (size_t i = 0; i < depth; i++)
+      address.push_back(1 + i % 4);
+    Pocket p(address, "0123456789abcdef");
+    printf("[Bench] addresses: depth %2u, %4u bits per v1 frame, %4u per v2 frame\n", (unsigned)depth,
+           (unsigned)frameBits(p, FRAME_VERSION_1), (unsigned)frameBits(p, FRAME_VERSION_2));
+  }
+  return 0;
+}
+
+// like decodeFrame for a frame with error correction, as PinReceiver
+// feeds it. corrected counts the repaired bits.
+static bool decodeProtectedFrame(const FrameBits &bits, FrameDecoder &frame, Pocket *target, size_t &corrected)
+{
+  FecDecoder fecBits;
+  frame.begin(target, FRAME_VERSION_5);
+  corrected = 0;
+  for (size_t i = 1; i < bits.count; i++)
+  {
+    bool complete = false;
+    if (frame.bits < FEC_PLAIN_BITS)
+    {
+      complete = frame.pushBit(bits[i]);
+    }
+    else if (fecBits.push(bits[i]))
+    {
+      uint8_t value = fecBits.value();
+      corrected += fecBits.corrected;
+      for (int k = 7; k >= 0; k--)
+        complete = frame.pushBit(value >> k & 1);
+    }
+    if (complete)
+      return i + 1 == bits.count;
+  }
+  return false;
+}
+
+static int fec()
+{
+  std::mt19937 random(7);
+  auto flip = [](FrameBits &bits, size_t i) { bits.bytes[i / 8] ^= 0x80 >> (i % 8); };
+
+  // one wrong bit, or two in a row, in every protected byte are repaired
+  for (int burst = 1; burst <= 2; burst++)
+  {
+    for (int t = 0; t < 50000; t++)
+    {
+      Pocket p = randomPocket(random, FRAME_VERSION_5);
+      FrameBits bits;
+      encodeFrame(p, FRAME_VERSION_5, bits);
+      protectFrame(bits);
+      if (bits.count != FEC_WIRE_BITS(frameBits(p, FRAME_VERSION_5)))
+      {
+        printf("[Bench] fec: %u wire bits instead of %u\n", bits.count,
+               (unsigned)FEC_WIRE_BITS(frameBits(p, FRAME_VERSION_5)));
+        return 1;
+      }
+
+      size_t bytes = (bits.count - FEC_PLAIN_BITS) / FEC_BYTE_BITS;
+      for (size_t b = 0; b < bytes; b++)
+      {
+        size_t at = FEC_PLAIN_BITS + b * FEC_BYTE_BITS + random() % (FEC_BYTE_BITS - burst + 1);
+        for (int k = 0; k < burst; k++)
+          flip(bits, at + k);
+      }
+
+      Pocket received;
+      FrameDecoder frame;
+      size_t corrected;
+      if (!decodeProtectedFrame(bits, frame, &received, corrected) || !frame.checksumOk() ||
+          !sameAsSent(p, received, FRAME_VERSION_5) || corrected != bytes * burst)
+      {
+        printf("[Bench] fec: a frame with %u wrong bits per byte was not repaired\n", burst);
+        return 1;
+      }
+    }
+  }
+  printf("[Bench] fec: single wrong bits and bursts of two in every byte are repaired\n");
+
+  // frames that arrive intact at a bit error rate, with and without
+  for (double rate : {1e-4, 1e-3, 1e-2})
+  {
+    const int trials = 20000;
+    int plain = 0, protectedOk = 0;
+    std::bernoulli_distribution wrong(rate);
+    for (int t = 0; t < trials; t++)
+    {
+      Pocket p = randomPocket(random, FRAME_VERSION_5);
+      for (bool protect : {false, true})
+      {
+        FrameBits bits;
+        encodeFrame(p, FRAME_VERSION_5, bits);
+        if (protect)
+          protectFrame(bits);
+        for (size_t i = FEC_PLAIN_BITS; i < bits.count; i++)
+        {
+          if (wrong(random))
+            flip(bits, i);
+        }
+
+        Pocket received;
+        FrameDecoder frame;
+        size_t corrected;
+        bool decoded = protect ? decodeProtectedFrame(bits, frame, &received, corrected)
+                               : decodeFrame(bits, frame, &received, FRAME_VERSION_5);
+        bool ok = decoded && frame.knownVersion && !frame.tooLong && frame.checksumOk() &&
+                  sameAsSent(p, received, FRAME_VERSION_5);
+        (protect ? protectedOk : plain) += ok;
+      }
+    }
+    printf("[Bench] fec: bit error rate %g, %5.1f %% of frames intact, %5.1f %% with error correction\n", rate,
+           100.0 * plain / trials, 100.0 * protectedOk / trials);
+  }
+  return 0;
+}
+
+struct BenchNode
+{
+  hal::sim::Board board;
+  PhysikalNode node;
+  std::atomic<size_t> received{0};
+  std::atomic<uint64_t> receivedAt{0}; // simMicros() of the last pocket
+};
+
+static void setup(BenchNode &n, const char *name, std::initializer_list<uint16_t> you)
+{
+  n.board.name = name;
+  for (uint16_t part : you)
+    n.node.logicalNode.you.push_back(part);
+  n.node.onData = [&n](const Pocket &)
+  {
+    n.receivedAt = hal::simMicros();
+    n.received++;
+  };
+}
+
+static void link(BenchNode &a, uint8_t pinA, BenchNode &b, uint8_t pinB)
+{
+  a.node.logicalNode.connections.push_back(Connection{b.node.logicalNode.you, pinA});
+  b.node.logicalNode.connections.push_back(Connection{a.node.logicalNode.you, pinB});
+  hal::sim::connect(a.board, pinA, b.board, pinB);
+}
+
+// starts every node and waits until every connection settled its version
+static bool start(BenchNode *nodes, size_t count)
+{
+  for (size_t i = 0; i < count; i++)
+  {
+    hal::sim::BoardScope scope(nodes[i].board);
+    nodes[i].node.logicalNode.updateRoutes();
+    nodes[i].node.start();
+  }
+
+  for (int wait = 0; wait < BENCH_NEGOTIATE_TIMEOUT_S * 10; wait++)
+  {
+    bool settled = true;
+    for (size_t i = 0; i < count; i++)
+    {
+      for (const Connection &c : nodes[i].node.logicalNode.connections)
+        settled = settled && c.helloLeft == 0;
+    }
+    if (settled)
+      return true;
+    hal::delayMs(100);
+  }
+  return false;
+}
+
+static void stop(BenchNode *nodes, size_t count)
+{
+  for (size_t i = 0; i < count; i++)
+  {
+    hal::sim::BoardScope scope(nodes[i].board);
+    nodes[i].node.stop();
+  }
+}
+
+static int multipathSim(size_t pockets, bool multipath)
+{
+  static BenchNode nodes[4];
+  BenchNode &source = nodes[0], &left = nodes[1], &right = nodes[2], &sink = nodes[3];
+
+  setup(source, "[1,3]", {1, 3});
+  setup(left, "[1,1]", {1, 1});
+  setup(right, "[1,2]", {1, 2});
+  setup(sink, "[1,4]", {1, 4});
+
+  link(source, 2, left, 2);
+  link(source, 3, right, 2);
+  link(left, 3, sink, 2);
+  link(right, 3, sink, 3);
+
+  source.node.logicalNode.multipath = multipath;
+  sink.node.trace.head = sink.node.trace.tail = 0;
+
+  if (!start(nodes, 4))
+  {
+    printf("[Bench] multipath: the connections did not settle\n");
+    stop(nodes, 4);
+    return 1;
+  }
+
+  // pockets [1,4] received on the pin from [1,1] and on the one from [1,2]
+  size_t viaLeft = 0, viaRight = 0;
+  auto count = [&]()
+  {
+    TraceRecord records[TRACE_RING_SIZE];
+    size_t n = sink.node.trace.drain(records, TRACE_RING_SIZE);
+    for (size_t i = 0; i < n; i++)
+    {
+      if (records[i].event == TRACE_RECEIVE)
+        (records[i].pin == 2 ? viaLeft : viaRight)++;
+    }
+  };
+
+  // the send queues of [1,3] are kept full until every pocket is queued
+  uint64_t burstStart = hal::simMicros();
+  for (size_t i = 0; i < pockets;)
+  {
+    char data[DATASIZE + 1];
+    snprintf(data, sizeof(data), "pocket %u", (unsigned)i);
+    Pocket p(sink.node.logicalNode.you, data);
+    hal::sim::BoardScope scope(source.board);
+    if (source.node.sendBatch(&p, 1) == 1)
+      i++;
+    else
+      hal::delayMs(10);
+    count();
+  }
+
+  while (sink.received < pockets && hal::simMicros() - burstStart < (uint64_t)pockets * BENCH_TIMEOUT_PER_POCKET_S * 1000000)
+  {
+    hal::delayMs(100);
+    count();
+  }
+
+  size_t delivered = sink.received;
+  double seconds = (sink.receivedAt - burstStart) / 1e6;
+
+  // every queued pocket left its node again, the backlogs that steer the
+  // paths are back at 0 once the last acknowledgements are in
+  hal::delayMs(2000);
+  unsigned backlog = 0;
+  for (BenchNode &n : nodes)
+  {
+    for (uint16_t queued : n.node.pinBacklog)
+      backlog += queued;
+  }
+  stop(nodes, 4);
+
+  printf("[Bench] multipath %s: %u/%u pockets in %.3f s, %.1f pockets/s, %u via [1,1], %u via [1,2]\n",
+         multipath ? "on" : "off", (unsigned)delivered, (unsigned)pockets, seconds, delivered / seconds,
+         (unsigned)viaLeft, (unsigned)viaRight);
+
+  if (delivered != pockets)
+    return 1;
+  if (backlog != 0)
+  {
+    printf("[Bench] multipath: %u pockets still counted as queued\n", backlog);
+    return 1;
+  }
+  // both paths carry a share of a burst large enough to split
+  if (multipath && pockets >= 8 && (viaLeft == 0 || viaRight == 0))
+    return 1;
+  return 0;
+}
+
+static int helloSim()
+{
+  struct Caps
+  {
+    uint8_t rate, lineCode;
+    bool fec;
+  };
+  // hub side, child side
+  static const Caps caps[4][2] = {
+      {{BIT_RATE_FASTEST, LINE_CODE_MANCHESTER, true}, {BIT_RATE_FASTEST, LINE_CODE_MANCHESTER, true}},
+      {{BIT_RATE_FASTEST, LINE_CODE_MANCHESTER, false}, {2, LINE_CODE_NRZ, true}},
+      {{1, LINE_CODE_NRZ, true}, {BIT_RATE_FASTEST, LINE_CODE_MANCHESTER, true}},
+      {{3, LINE_CODE_MANCHESTER, true}, {4, LINE_CODE_MANCHESTER, false}},
+  };
+  static BenchNode nodes[5];
+  static const char *names[5] = {"[1]", "[1,1]", "[1,2]", "[1,3]", "[1,4]"};
+  BenchNode &hub = nodes[0];
+
+  setup(hub, names[0], {1});
+  for (uint16_t i = 1; i < 5; i++)
+  {
+    setup(nodes[i], names[i], {1, i});
+    link(hub, i + 1, nodes[i], 2);
+    Connection &up = nodes[i].node.logicalNode.connections.back();
+    Connection &down = hub.node.logicalNode.connections.back();
+    down.rateCap = caps[i - 1][0].rate;
+    down.lineCodeCap = caps[i - 1][0].lineCode;
+    down.fecCap = caps[i - 1][0].fec;
+    up.rateCap = caps[i - 1][1].rate;
+    up.lineCodeCap = caps[i - 1][1].lineCode;
+    up.fecCap = caps[i - 1][1].fec;
+  }
+
+  bool settled = start(nodes, 5);
+  double seconds = hal::simMicros() / 1e6;
+  int failed = settled ? 0 : 1;
+
+  for (int i = 1; i < 5; i++)
+  {
+    const Connection &down = hub.node.logicalNode.connections[i - 1];
+    const Connection &up = nodes[i].node.logicalNode.connections[0];
+    const Caps &a = caps[i - 1][0], &b = caps[i - 1][1];
+    bool agreed = down.version == FRAME_VERSION_MAX && up.version == FRAME_VERSION_MAX &&
+                  down.rate == min(a.rate, b.rate) && up.rate == down.rate &&
+                  down.lineCode == min(a.lineCode, b.lineCode) && up.lineCode == down.lineCode &&
+                  down.fec == (a.fec && b.fec) && up.fec == down.fec;
+    printf("[Bench] hello: [1] - %s v%u/v%u, %u/%u us per bit, %s/%s%s\n", names[i], down.version, up.version,
+           (unsigned)down.bitTime(), (unsigned)up.bitTime(), lineCodeName(down.lineCode), lineCodeName(up.lineCode),
+           down.fec && up.fec ? ", error correction" : down.fec != up.fec ? ", error correction on one end" : "");
+    if (!agreed)
+      failed = 1;
+  }
+  stop(nodes, 5);
+
+  printf("[Bench] hello: %s after %.3f s simulated\n", failed ? "negotiation failed" : "every pair agreed", seconds);
+  return failed;
+}
+
+// [1] sends `pockets` pockets to each of `links` children at once, the
+// queue of every pin is kept full, aggregate pockets/s from the first send to
+// the last pocket delivered. Pocket ids are random, a child drops the rare
+// pocket whose id it saw within DUPLICATE_EXPIRY_MS as a copy.
+static int hubRun(size_t links, size_t pockets)
+{
+  static char names[8][16];
+  BenchNode *nodes = new BenchNode[links + 1];
+  BenchNode &hub = nodes[0];
+
+  setup(hub, "[1]", {1});
+  for (uint16_t i = 1; i <= links; i++)
+  {
+    snprintf(names[i - 1], sizeof(names[i - 1]), "[1,%u]", i);
+    setup(nodes[i], names[i - 1], {1, i});
+    link(hub, i + 1, nodes[i], 2);
+  }
+
+  if (!start(nodes, links + 1))
+  {
+    printf("[Bench] hub: %u links did not settle\n", (unsigned)links);
+    stop(nodes, links + 1);
+    delete[] nodes;
+    return 1;
+  }
+
+  vector<size_t> sent(links + 1, 0);
+  uint64_t burstStart = hal::simMicros();
+  uint64_t deadline = burstStart + (uint64_t)pockets * BENCH_TIMEOUT_PER_POCKET_S * 1000000;
+  size_t delivered = 0;
+  bool allSent = false, backlog = true;
+
+  // until every pocket is delivered, or sent and acknowledged
+  while (delivered < links * pockets && !(allSent && !backlog) && hal::simMicros() < deadline)
+  {
+    {
+      hal::sim::BoardScope scope(hub.board);
+      for (size_t i = 1; i <= links; i++)
+      {
+        uint8_t pin = i + 1;
+        while (sent[i] < pockets && hub.node.pinBacklog[pin] < PIN_QUEUE_SIZE)
+        {
+          char data[DATASIZE + 1];
+          snprintf(data, sizeof(data), "hub %u", (unsigned)sent[i]);
+          Pocket p(nodes[i].node.logicalNode.you, data);
+          if (hub.node.sendBatch(&p, 1) == 0)
+            break;
+          sent[i]++;
+        }
+      }
+    }
+    hal::delayMs(2);
+
+    delivered = 0;
+    allSent = true;
+    backlog = false;
+    for (size_t i = 1; i <= links; i++)
+    {
+      delivered += nodes[i].received;
+      allSent = allSent && sent[i] == pockets;
+      backlog = backlog || hub.node.pinBacklog[i + 1] > 0;
+    }
+  }
+
+  size_t copies = 0;
+  for (size_t i = 1; i <= links; i++)
+    copies += nodes[i].node.duplicates.duplicates;
+
+  uint64_t lastAt = burstStart;
+  for (size_t i = 1; i <= links; i++)
+    lastAt = max<uint64_t>(lastAt, nodes[i].receivedAt);
+  double seconds = (lastAt - burstStart) / 1e6;
+  const Connection &c = hub.node.logicalNode.connections[0];
+  stop(nodes, links + 1);
+  delete[] nodes;
+
+  printf("[Bench] hub: %u links, %4u/%u pockets in %.3f s, %6.1f pockets/s aggregate, %5.1f per link, %u dropped as "
+         "copies, v%u at %u us per bit\n",
+         (unsigned)links, (unsigned)delivered, (unsigned)(links * pockets), seconds, delivered / seconds,
+         delivered / seconds / links, (unsigned)copies, c.version, (unsigned)c.bitTime());
+  return delivered + copies >= links * pockets ? 0 : 1;
+}
+
+static int hubSim(size_t pockets)
+{
+  for (size_t links : {2, 4, 8})
+  {
+    if (hubRun(links, pockets) != 0)
+      return 1;
+  }
+  return 0;
+}
+
+static int chainSim(size_t pockets, bool cutThrough)
+{
+  static BenchNode nodes[7];
+  static char names[7][32];
+
+  for (int i = 0; i < 7; i++)
+  {
+    strcpy(names[i], "[1");
+    for (int k = 0; k < i; k++)
+      strcat(names[i], ",1");
+    strcat(names[i], "]");
+    setup(nodes[i], names[i], {});
+    for (int k = 0; k <= i; k++)
+      nodes[i].node.logicalNode.you.push_back(1);
+    nodes[i].node.cutThrough = cutThrough;
+  }
+  for (int i = 0; i + 1 < 7; i++)
+    link(nodes[i], 3, nodes[i + 1], 2);
+
+  if (!start(nodes, 7))
+  {
+    printf("[Bench] chain: the connections did not settle\n");
+    stop(nodes, 7);
+    return 1;
+  }
+
+  BenchNode &source = nodes[6], &sink = nodes[0];
+  double sum = 0, lowest = 0, highest = 0;
+  size_t delivered = 0;
+
+  for (size_t i = 0; i < pockets; i++)
+  {
+    uint64_t sentAt = hal::simMicros();
+    {
+      hal::sim::BoardScope scope(source.board);
+      source.node.send(sink.node.logicalNode.you, "latency probe 0123456789abcdef");
+    }
+    while (sink.received <= i && hal::simMicros() - sentAt < (uint64_t)BENCH_TIMEOUT_PER_POCKET_S * 1000000)
+      hal::delayMs(5);
+    if (sink.received <= i)
+      break;
+
+    double ms = (sink.receivedAt - sentAt) / 1000.0;
+    sum += ms;
+    lowest = delivered == 0 || ms < lowest ? ms : lowest;
+    highest = ms > highest ? ms : highest;
+    delivered++;
+
+    // the next one starts on an idle chain
+    hal::delayMs(300);
+  }
+
+  uint32_t relayed = 0, cutOff = 0;
+  for (BenchNode &n : nodes)
+  {
+    relayed += n.node.relayed;
+    cutOff += n.node.relaysCut;
+  }
+  const Connection &c = sink.node.logicalNode.connections[0];
+  printf("[Bench] chain cut-through %s: %u/%u pockets, latency %.1f ms mean, %.1f min, %.1f max, %u relayed, %u cut "
+         "off, v%u at %u us per bit\n",
+         cutThrough ? "on" : "off", (unsigned)delivered, (unsigned)pockets, delivered ? sum / delivered : 0, lowest,
+         highest, (unsigned)relayed, (unsigned)cutOff, c.version, (unsigned)c.bitTime());
+  stop(nodes, 7);
+
+  return delivered == pockets ? 0 : 1;
+}
+
+static int jitterSim(size_t pockets, int32_t drift, uint32_t jitter)
+{
+  static BenchNode nodes[3];
+  BenchNode &sink = nodes[0], &middle = nodes[1], &source = nodes[2];
+
+  setup(sink, "[1]", {1});
+  setup(middle, "[1,1]", {1, 1});
+  setup(source, "[1,1,1]", {1, 1, 1});
+  link(sink, 2, middle, 2);
+  link(middle, 3, source, 2);
+
+  // [1,1] between a clock `drift` ppm slow and one as much fast
+  middle.board.driftPpm = -drift;
+  source.board.driftPpm = drift;
+  for (BenchNode &n : nodes)
+  {
+    n.board.jitterUs = jitter;
+    for (Connection &c : n.node.logicalNode.connections)
+      c.lineCodeCap = LINE_CODE_MANCHESTER;
+  }
+
+  if (!start(nodes, 3))
+  {
+    printf("[Bench] jitter: the connections did not settle\n");
+    stop(nodes, 3);
+    return 1;
+  }
+  for (BenchNode &n : nodes)
+  {
+    for (const Connection &c : n.node.logicalNode.connections)
+    {
+      if (c.dataLineCode() != LINE_CODE_MANCHESTER)
+      {
+        printf("[Bench] jitter: %s pin %u settled on %s at %u us per bit\n", n.board.name, c.pin,
+               lineCodeName(c.dataLineCode()), (unsigned)c.bitTime());
+        stop(nodes, 3);
+        return 1;
+      }
+    }
+  }
+
+  uint64_t sentAt = hal::simMicros();
+  for (size_t i = 0; i < pockets;)
+  {
+    char data[DATASIZE + 1];
+    snprintf(data, sizeof(data), "jitter %u", (unsigned)i);
+    Pocket p(sink.node.logicalNode.you, data);
+    hal::sim::BoardScope scope(source.board);
+    if (source.node.sendBatch(&p, 1) == 1)
+      i++;
+    else
+      hal::delayMs(10);
+  }
+  while (sink.received < pockets && hal::simMicros() - sentAt < (uint64_t)pockets * BENCH_TIMEOUT_PER_POCKET_S * 1000000)
+    hal::delayMs(100);
+
+  // what the receivers dropped on the way, every lost frame is sent again
+  size_t brokeOff = 0, mismatches = 0;
+  for (BenchNode &n : nodes)
+  {
+    TraceRecord records[TRACE_RING_SIZE];
+    size_t count;
+    while ((count = n.node.trace.drain(records, TRACE_RING_SIZE)) > 0)
+    {
+      for (size_t i = 0; i < count; i++)
+      {
+        brokeOff += records[i].event == TRACE_BROKE_OFF;
+        mismatches += records[i].event == TRACE_CHECKSUM_ERROR;
+      }
+    }
+  }
+
+  size_t delivered = sink.received;
+  const Connection &c = middle.node.logicalNode.connections[1];
+  printf("[Bench] jitter: drift +-%d ppm, %u us jitter, %u/%u pockets over two hops, v%u at %u us per bit, %u frames "
+         "broke off, %u checksum mismatches\n",
+         (int)drift, (unsigned)jitter, (unsigned)delivered, (unsigned)pockets, c.version, (unsigned)c.bitTime(),
+         (unsigned)brokeOff, (unsigned)mismatches);
+  stop(nodes, 3);
+
+  return delivered == pockets ? 0 : 1;
+}
+
+// Pockets longer than a v1 frame carries: [1,1] sends one to [1] right
+// after the start, while its connection still speaks v1, it waits for the
+// hello. [2,1] and [2] act as if the other end had old firmware, their
+// connection stays at v1: the data is cut to FRAME_FIXED_DATASIZE bytes and
+// a fragmented message is refused by send.
+static int earlySim()
+{
+  static BenchNode nodes[4];
+  static size_t lengths[4];
+  BenchNode &root = nodes[0], &leaf = nodes[1], &oldRoot = nodes[2], &oldLeaf = nodes[3];
+
+  setup(root, "[1]", {1});
+  setup(leaf, "[1,1]", {1, 1});
+  setup(oldRoot, "[2]", {2});
+  setup(oldLeaf, "[2,1]", {2, 1});
+  link(root, 2, leaf, 2);
+  link(oldRoot, 2, oldLeaf, 2);
+  for (size_t i = 0; i < 4; i++)
+  {
+    nodes[i].node.onData = [i](const Pocket &p)
+    {
+      lengths[i] = p.length;
+      nodes[i].received++;
+    };
+  }
+  for (size_t i = 2; i < 4; i++)
+    nodes[i].node.logicalNode.connections[0].helloLeft = 0;
+
+  for (BenchNode &n : nodes)
+  {
+    hal::sim::BoardScope scope(n.board);
+    n.node.logicalNode.updateRoutes();
+    n.node.start();
+  }
+
+  const char *data = "twenty bytes of data";
+  bool sentEarly, sentOld, sentFragments;
+  {
+    hal::sim::BoardScope scope(leaf.board);
+    sentEarly = leaf.node.send(root.node.logicalNode.you, data);
+  }
+  {
+    hal::sim::BoardScope scope(oldLeaf.board);
+    sentOld = oldLeaf.node.send(oldRoot.node.logicalNode.you, data);
+    char message[2 * DATASIZE];
+    memset(message, 'm', sizeof(message));
+    sentFragments = oldLeaf.node.send(oldRoot.node.logicalNode.you, message, sizeof(message));
+  }
+
+  uint64_t start = hal::simMicros();
+  while ((root.received == 0 || oldRoot.received == 0) &&
+         hal::simMicros() - start < (uint64_t)BENCH_NEGOTIATE_TIMEOUT_S * 1000000)
+    hal::delayMs(100);
+
+  uint8_t version = leaf.node.logicalNode.connections[0].version;
+  stop(nodes, 4);
+
+  printf("[Bench] early: sent %u, %u bytes arrived over a v%u connection after its hello\n", sentEarly,
+         root.received ? (unsigned)lengths[0] : 0, version);
+  printf("[Bench] early: sent %u, %u bytes arrived over a v1 connection, fragments sent %u\n", sentOld,
+         oldRoot.received ? (unsigned)lengths[2] : 0, sentFragments);
+
+  bool ok = sentEarly && root.received == 1 && lengths[0] == strlen(data) && version >= FRAME_VERSION_3 && sentOld &&
+            oldRoot.received == 1 && lengths[2] == FRAME_FIXED_DATASIZE && !sentFragments;
+  return ok ? 0 : 1;
+}
+
+// [1,1] misread the ok bit of the last hello answer and stays at v1 while
+// [1] switched: the frames of both ends are unreadable for the other one
+// until they negotiate again.
+static int misreadSim(size_t pockets)
+{
+  static BenchNode nodes[2];
+  BenchNode &root = nodes[0], &leaf = nodes[1];
+
+  setup(root, "[1]", {1});
+  setup(leaf, "[1,1]", {1, 1});
+  link(root, 2, leaf, 2);
+  if (!start(nodes, 2))
+  {
+    printf("[Bench] misread: the connection never settled\n");
+    stop(nodes, 2);
+    return 1;
+  }
+
+  Connection &misread = leaf.node.logicalNode.connections[0];
+  leaf.node.logicalNode.routesLock.lock();
+  misread.version = FRAME_VERSION_1;
+  misread.rate = 0;
+  misread.lineCode = LINE_CODE_NRZ;
+  misread.fec = false;
+  leaf.node.logicalNode.routesLock.unlock();
+
+  size_t sent = 0;
+  for (size_t i = 0; i < pockets; i++)
+  {
+    char data[16];
+    snprintf(data, sizeof(data), "misread %02u", (unsigned)(i % 100));
+    {
+      hal::sim::BoardScope scope(leaf.board);
+      sent += leaf.node.send(root.node.logicalNode.you, data);
+    }
+    {
+      hal::sim::BoardScope scope(root.board);
+      sent += root.node.send(leaf.node.logicalNode.you, data);
+    }
+    hal::delayMs(1000);
+  }
+
+  uint64_t start = hal::simMicros();
+  while (root.received + leaf.received < sent &&
+         hal::simMicros() - start < (uint64_t)BENCH_NEGOTIATE_TIMEOUT_S * 1000000)
+    hal::delayMs(100);
+
+  uint8_t versions[2] = {root.node.logicalNode.connections[0].version, misread.version};
+  stop(nodes, 2);
+
+  size_t received = root.received + leaf.received;
+  printf("[Bench] misread: %u/%u pockets arrived, the connection speaks v%u and v%u again\n", (unsigned)received,
+         (unsigned)(2 * pockets), versions[0], versions[1]);
+  return received == 2 * pockets && versions[0] == versions[1] ? 0 : 1;
+}
+
+static size_t argument(int argc, char **argv, int i, size_t fallback)
+{
+  return argc > i ? strtoul(argv[i], nullptr, 10) : fallback;
+}
+
+// every mode in its own function, so its timing loops aren't inlined into
+// one huge main
+struct Mode
+{
+  const char *name;
+  int (*run)(int argc, char **argv);
+};
+
+static const Mode modes[] = {
+    {"routes", [](int, char **) { return routes(); }},
+    {"cache", [](int, char **) { return cache(); }},
+    {"storage", [](int, char **) { return storage(); }},
+    {"compare", [](int, char **) { return compare(); }},
+    {"forward", [](int, char **) { return forward(); }},
+    {"frames", [](int, char **) { return frames(); }},
+    {"crc", [](int, char **) { return crcs(); }},
+    {"duplicates", [](int, char **) { return duplicates(); }},
+    {"addresses", [](int, char **) { return addresses(); }},
+    {"fec", [](int, char **) { return fec(); }},
+    {"multipath", [](int argc, char **argv)
+     { return multipathSim(argument(argc, argv, 2, 32), argument(argc, argv, 3, 1) != 0); }},
+    {"hello", [](int, char **) { return helloSim(); }},
+    {"chain", [](int argc, char **argv)
+     { return chainSim(argument(argc, argv, 2, 10), argument(argc, argv, 3, 1) != 0); }},
+    {"early", [](int, char **) { return earlySim(); }},
+    {"misread", [](int argc, char **argv) { return misreadSim(argument(argc, argv, 2, 8)); }},
+    {"hub", [](int argc, char **argv) { return hubSim(argument(argc, argv, 2, 32)); }},
+    {"jitter", [](int argc, char **argv)
+     { return jitterSim(argument(argc, argv, 2, 16), argument(argc, argv, 3, 2000), argument(argc, argv, 4, 40)); }},
+};
+
+int main(int argc, char **argv)
+{
+  const char *mode = argc > 1 ? argv[1] : "";
+
+  for (const Mode &m : modes)
+  {
+    if (strcmp(mode, m.name) == 0)
+      return m.run(argc, argv);
+  }
+
+  printf("usage: %s", argv[0]);
+  for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); i++)
+    printf("%s%s", i == 0 ? " " : "|", modes[i].name);
+  printf("\n");
+  return 2;
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <Arduino.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+#include <esp_timer.h>
+
+#define HAL_LOGF(...) Serial.printf(__VA_ARGS__)
+#define HAL_ISR_ATTR IRAM_ATTR
+
+namespace hal
+{
+  inline void pinMode(uint8_t pin, uint8_t mode) { ::pinMode(pin, mode); }
+  inline int digitalRead(uint8_t pin) { return ::digitalRead(pin); }
+  inline void digitalWrite(uint8_t pin, uint8_t level) { ::digitalWrite(pin, level); }
+
+  // isr(arg) runs on every level change of pin, isr has to be HAL_ISR_ATTR
+  inline void attachEdgeInterrupt(uint8_t pin, void (*isr)(void *), void *arg) { ::attachInterruptArg(pin, isr, arg, CHANGE); }
+  inline void detachEdgeInterrupt(uint8_t pin) { ::detachInterrupt(pin); }
+
+  inline void delayMicroseconds(uint32_t us) { ::delayMicroseconds(us); }
+  inline void delayMs(uint32_t ms) { vTaskDelay(pdMS_TO_TICKS(ms)); }
+  inline uint32_t micros() { return ::micros(); }
+  inline uint32_t millis() { return ::millis(); }
+
+  inline long random(long max) { return ::random(max); }
+
+  struct Spinlock
+  {
+    portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+
+    void lock() { portENTER_CRITICAL(&mux); }
+    void unlock() { portEXIT_CRITICAL(&mux); }
+  };
+
+  // for longer sections, the holder may log or be preempted
+  struct Mutex
+  {
+    StaticSemaphore_t buffer;
+    SemaphoreHandle_t handle = xSemaphoreCreateMutexStatic(&buffer);
+
+    void lock() { xSemaphoreTake(handle, portMAX_DELAY); }
+    void unlock() { xSemaphoreGive(handle); }
+  };
+
+  struct Task
+  {
+    TaskHandle_t handle = nullptr;
+
+    bool started() const { return handle != nullptr; }
+
+    bool start(void (*fn)(void *), void *arg, const char *name, uint32_t stackSize)
+    {
+      return xTaskCreate(fn, name, stackSize, arg, 1, &handle) == pdPASS;
+    }
+
+    void stop()
+    {
+      if (handle != nullptr)
+      {
+        vTaskDelete(handle);
+        handle = nullptr;
+      }
+    }
+  };
+
+  // periodic callback from the esp_timer task
+  struct Timer
+  {
+    esp_timer_handle_t handle = nullptr;
+
+    bool started() const { return handle != nullptr; }
+
+    bool start(void (*fn)(void *), void *arg, const char *name, uint32_t periodUs)
+    {
+      esp_timer_create_args_t args = {};
+      args.callback = fn;
+      args.arg = arg;
+      args.dispatch_method = ESP_TIMER_TASK;
+      args.name = name;
+      if (esp_timer_create(&args, &handle) != ESP_OK)
+      {
+        handle = nullptr;
+        return false;
+      }
+      return esp_timer_start_periodic(handle, periodUs) == ESP_OK;
+    }
+
+    void stop()
+    {
+      if (handle != nullptr)
+      {
+        esp_timer_stop(handle);
+        esp_timer_delete(handle);
+        handle = nullptr;
+      }
+    }
+  };
+}
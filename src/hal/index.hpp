@@ -0,0 +1,12 @@
+#pragma once
+
+// Thin hardware abstraction for the protocol code: GPIO, edge interrupts,
+// timing, logging, locks, tasks, timers and queues. On the esp32 it maps 1:1
+// onto Arduino, FreeRTOS and esp_timer, on the host (pio run -e native) onto
+// simulated wires driven by a virtual clock, see native.hpp.
+
+#ifdef ARDUINO
+#include "./esp32.hpp"
+#else
+#include "./native.hpp"
+#endif
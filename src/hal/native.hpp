@@ -0,0 +1,415 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <map>
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <random>
+#include <condition_variable>
+
+// Host implementation of the HAL.
+//
+// A board is a set of pins, sim::connect attaches pins of different boards
+// to one shared wire. A wire reads HIGH while any attached pin drives it HIGH,
+// otherwise it is pulled down. Every simulated thread runs code for exactly
+// one board (the one that was current when its task was started). Edge
+// interrupts run right after the write that changed the level, in the
+// writing thread but with their own board current.
+//
+// Time is virtual: the clock only moves when every simulated thread sleeps,
+// then it jumps to the earliest wake up. Bit timing is therefore exact and a
+// 50 ms bit costs no real time, unless a board is given a clock drift (its
+// micros() runs driftPpm faster) or jitter (every delay of its code takes up
+// to jitterUs longer, like a late timer or interrupt). A noisy board reads
+// the wrong level with probability flipRate, in its edge interrupts too, so
+// a data frame bit is wrong at about that rate.
+
+#define HIGH 0x1
+#define LOW 0x0
+#define INPUT 0x01
+#define OUTPUT 0x03
+#define INPUT_PULLDOWN 0x09
+
+#define HAL_LOGF(...) fprintf(stderr, __VA_ARGS__)
+#define HAL_ISR_ATTR
+
+namespace hal
+{
+  namespace sim
+  {
+    struct Board;
+
+    struct Wire
+    {
+      int highDrivers = 0;
+      std::vector<std::pair<Board *, uint8_t>> pins;
+
+      bool level() const { return highDrivers > 0; }
+    };
+
+    struct Pin
+    {
+      Wire *wire = nullptr;
+      uint8_t mode = INPUT;
+      uint8_t level = LOW;
+      void (*isr)(void *) = nullptr; // called on every level change
+      void *isrArg = nullptr;
+
+      bool drivesHigh() const { return mode == OUTPUT && level == HIGH; }
+    };
+
+    struct Board
+    {
+      const char *name;
+      std::map<uint8_t, Pin> pins;
+      int32_t driftPpm = 0;
+      uint32_t jitterUs = 0;
+      double flipRate = 0;
+
+      explicit Board(const char *name_ = "board") : name(name_) {}
+    };
+
+    struct Clock
+    {
+      std::mutex mutex;
+      uint64_t now = 0;
+      int running = 1; // simulated threads that are not sleeping, main counts
+      std::multimap<uint64_t, std::condition_variable *> sleepers;
+
+      // caller holds mutex
+      void advanceIfIdle()
+      {
+        if (running > 0 || sleepers.empty())
+          return;
+
+        now = sleepers.begin()->first;
+        while (!sleepers.empty() && sleepers.begin()->first == now)
+        {
+          sleepers.begin()->second->notify_one();
+          sleepers.erase(sleepers.begin());
+          running++;
+        }
+      }
+
+      void sleepFor(uint64_t us)
+      {
+        static thread_local std::condition_variable wakeup;
+
+        std::unique_lock<std::mutex> lock(mutex);
+        if (us == 0)
+          return;
+
+        uint64_t until = now + us;
+        sleepers.insert(std::make_pair(until, &wakeup));
+        running--;
+        advanceIfIdle();
+        wakeup.wait(lock, [&]()
+                    { return now >= until; });
+      }
+
+      // the calling thread stops taking part, e.g. while it joins another one
+      void detach()
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        running--;
+        advanceIfIdle();
+      }
+
+      void attach()
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        running++;
+      }
+    };
+
+    inline Clock &clock()
+    {
+      static Clock instance;
+      return instance;
+    }
+
+    inline Board *&currentBoard()
+    {
+      static thread_local Board *board = nullptr;
+      return board;
+    }
+
+    // makes board the current one for this thread until the scope ends
+    struct BoardScope
+    {
+      Board *previous;
+
+      explicit BoardScope(Board &board) : previous(currentBoard()) { currentBoard() = &board; }
+      ~BoardScope() { currentBoard() = previous; }
+    };
+
+    inline std::deque<Wire> &wires()
+    {
+      static std::deque<Wire> instance;
+      return instance;
+    }
+
+    inline void connect(Board &a, uint8_t pinA, Board &b, uint8_t pinB)
+    {
+      std::lock_guard<std::mutex> lock(clock().mutex);
+      wires().push_back(Wire());
+      Wire &wire = wires().back();
+      wire.pins.push_back(std::make_pair(&a, pinA));
+      wire.pins.push_back(std::make_pair(&b, pinB));
+      a.pins[pinA].wire = &wire;
+      b.pins[pinB].wire = &wire;
+    }
+
+    inline std::mt19937 &rng()
+    {
+      static std::mt19937 instance(1);
+      return instance;
+    }
+
+    // caller holds clock().mutex
+    inline Pin &pin(uint8_t number)
+    {
+      Board *board = currentBoard();
+      if (board == nullptr)
+      {
+        fprintf(stderr, "[Sim] pin %u used outside of a board\n", number);
+        abort();
+      }
+      return board->pins[number];
+    }
+
+    struct Interrupt
+    {
+      Board *board;
+      void (*isr)(void *);
+      void *arg;
+    };
+
+    // caller holds clock().mutex, interrupts of pins that see a new level
+    // are added to fired
+    inline void drive(Pin &p, bool wasHigh, std::vector<Interrupt> &fired)
+    {
+      if (wasHigh == p.drivesHigh())
+        return;
+
+      if (!p.wire)
+      {
+        if (p.isr)
+          fired.push_back(Interrupt{currentBoard(), p.isr, p.isrArg});
+        return;
+      }
+
+      bool before = p.wire->level();
+      p.wire->highDrivers += p.drivesHigh() ? 1 : -1;
+      if (before == p.wire->level())
+        return;
+
+      for (auto &attached : p.wire->pins)
+      {
+        Pin &other = attached.first->pins[attached.second];
+        if (other.isr)
+          fired.push_back(Interrupt{attached.first, other.isr, other.isrArg});
+      }
+    }
+
+    // runs interrupts once clock().mutex is released
+    inline void run(const std::vector<Interrupt> &fired)
+    {
+      for (const Interrupt &interrupt : fired)
+      {
+        BoardScope scope(*interrupt.board);
+        interrupt.isr(interrupt.arg);
+      }
+    }
+  }
+
+  inline void pinMode(uint8_t pin, uint8_t mode)
+  {
+    std::vector<sim::Interrupt> fired;
+    {
+      std::lock_guard<std::mutex> lock(sim::clock().mutex);
+      sim::Pin &p = sim::pin(pin);
+      bool wasHigh = p.drivesHigh();
+      p.mode = mode;
+      sim::drive(p, wasHigh, fired);
+    }
+    sim::run(fired);
+  }
+
+  inline int digitalRead(uint8_t pin)
+  {
+    std::lock_guard<std::mutex> lock(sim::clock().mutex);
+    sim::Pin &p = sim::pin(pin);
+    bool level = p.wire ? p.wire->level() : p.drivesHigh();
+    double flipRate = sim::currentBoard()->flipRate;
+    if (flipRate > 0 && std::uniform_real_distribution<double>(0, 1)(sim::rng()) < flipRate)
+      level = !level;
+    return level ? HIGH : LOW;
+  }
+
+  inline void digitalWrite(uint8_t pin, uint8_t level)
+  {
+    std::vector<sim::Interrupt> fired;
+    {
+      std::lock_guard<std::mutex> lock(sim::clock().mutex);
+      sim::Pin &p = sim::pin(pin);
+      bool wasHigh = p.drivesHigh();
+      p.level = level ? HIGH : LOW;
+      sim::drive(p, wasHigh, fired);
+    }
+    sim::run(fired);
+  }
+
+  // isr(arg) runs on every level change of pin
+  inline void attachEdgeInterrupt(uint8_t pin, void (*isr)(void *), void *arg)
+  {
+    std::lock_guard<std::mutex> lock(sim::clock().mutex);
+    sim::Pin &p = sim::pin(pin);
+    p.isr = isr;
+    p.isrArg = arg;
+  }
+
+  inline void detachEdgeInterrupt(uint8_t pin)
+  {
+    std::lock_guard<std::mutex> lock(sim::clock().mutex);
+    sim::pin(pin).isr = nullptr;
+  }
+
+  namespace sim
+  {
+    // simulated time a delay of us takes on the current board
+    inline uint64_t boardDelay(uint64_t us)
+    {
+      Board *board = currentBoard();
+      if (board == nullptr)
+        return us;
+
+      us = us * 1000000 / (1000000 + board->driftPpm);
+      if (board->jitterUs > 0)
+      {
+        std::lock_guard<std::mutex> lock(clock().mutex);
+        us += std::uniform_int_distribution<uint32_t>(0, board->jitterUs)(rng());
+      }
+      return us;
+    }
+  }
+
+  inline void delayMicroseconds(uint32_t us) { sim::clock().sleepFor(sim::boardDelay(us)); }
+  inline void delayMs(uint32_t ms) { sim::clock().sleepFor(sim::boardDelay((uint64_t)ms * 1000)); }
+
+  inline uint64_t simMicros()
+  {
+    std::lock_guard<std::mutex> lock(sim::clock().mutex);
+    return sim::clock().now;
+  }
+
+  // time on the clock of the current board
+  inline uint64_t boardMicros()
+  {
+    uint64_t now = simMicros();
+    sim::Board *board = sim::currentBoard();
+    if (board == nullptr)
+      return now;
+    return now + (int64_t)now * board->driftPpm / 1000000;
+  }
+
+  inline uint32_t micros() { return (uint32_t)boardMicros(); }
+  inline uint32_t millis() { return (uint32_t)(boardMicros() / 1000); }
+
+  inline long random(long max)
+  {
+    std::lock_guard<std::mutex> lock(sim::clock().mutex);
+    return std::uniform_int_distribution<long>(0, max - 1)(sim::rng());
+  }
+
+  struct Spinlock
+  {
+    std::mutex mutex;
+
+    void lock() { mutex.lock(); }
+    void unlock() { mutex.unlock(); }
+  };
+
+  // for longer sections, the holder may log or be preempted
+  struct Mutex
+  {
+    std::mutex mutex;
+
+    void lock() { mutex.lock(); }
+    void unlock() { mutex.unlock(); }
+  };
+
+  struct Task
+  {
+    std::thread thread;
+
+    bool started() const { return thread.joinable(); }
+
+    bool start(void (*fn)(void *), void *arg, const char *, uint32_t)
+    {
+      sim::Board *board = sim::currentBoard();
+      sim::clock().attach();
+      thread = std::thread([fn, arg, board]()
+                           {
+                             sim::currentBoard() = board;
+                             fn(arg);
+                             sim::clock().detach(); });
+      return true;
+    }
+
+    // threads can't be killed, fn has to return on its own
+    void stop()
+    {
+      if (!thread.joinable())
+        return;
+
+      sim::clock().detach();
+      thread.join();
+      sim::clock().attach();
+    }
+  };
+
+  // periodic callback from its own thread, with the starting board current
+  struct Timer
+  {
+    std::thread thread;
+    volatile bool running = false;
+
+    bool started() const { return thread.joinable(); }
+
+    bool start(void (*fn)(void *), void *arg, const char *, uint32_t periodUs)
+    {
+      sim::Board *board = sim::currentBoard();
+      running = true;
+      sim::clock().attach();
+      thread = std::thread([this, fn, arg, board, periodUs]()
+                           {
+                             sim::currentBoard() = board;
+                             while (true)
+                             {
+                               delayMicroseconds(periodUs);
+                               if (!running)
+                                 break;
+                               fn(arg);
+                             }
+                             sim::clock().detach(); });
+      return true;
+    }
+
+    void stop()
+    {
+      if (!thread.joinable())
+        return;
+
+      running = false;
+      sim::clock().detach();
+      thread.join();
+      sim::clock().attach();
+    }
+  };
+}
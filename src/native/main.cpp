@@ -0,0 +1,298 @@
+// Host simulation, build and run with `pio run -e native` and
+// `.pio/build/native/program [pockets] [nrz|manchester] [drift ppm] [jitter us] [message bytes]
+// [bit error rate] [ack window] [cut-through 0|1] [bundles 0|1] [duplex 0|1]
+// [collision detect 0|1] [saturate s] [fec 0|1]`.
+//
+// Every node runs the real framing and routing code of src/protocoll on
+// simulated wires (see hal/native.hpp). The tree:
+//
+//          [1]
+//        2/   \3
+//       2/     \2
+//    [1,1]     [1,2]
+//       3|
+//       2|
+//   [1,1,1]
+//
+// Once every connection settled its frame version, [1,1,1] sends `pockets`
+// pockets to [1,2], three hops away, and then one message of `message`
+// bytes (fragmented if it is longer than DATASIZE). The line code is offered on every
+// connection, the clocks of [1,1,1] and [1,2] run `drift` ppm fast and the
+// one of [1,1] as much slow, every board gets `jitter` us of timer jitter.
+// After the negotiation every board reads a wrong level at `bit error rate`,
+// v5 connections keep up to `ack window` pockets unacknowledged (1 = stop
+// and wait), `cut-through` lets [1,1] and [1] relay frames while they arrive,
+// `bundles` lets queued pockets share a frame, `duplex` makes every
+// connection two-wire (each end sends on its pin + SIM_TX_PIN_OFFSET),
+// `collision detect` reads shared wires back while sending, `fec` offers
+// error correction on every connection. At last both ends of [1] - [1,2]
+// keep its queues full for `saturate` seconds.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <initializer_list>
+
+// the simulated nodes share one pocket pool
+#define POCKET_POOL_SIZE 256
+
+#include "../hal/index.hpp"
+#include "../protocoll/index.hpp"
+
+#define SIM_TIMEOUT_PER_POCKET_S 120
+#define SIM_NEGOTIATE_TIMEOUT_S 120
+#define SIM_TX_PIN_OFFSET 8
+
+struct SimNode
+{
+  hal::sim::Board board;
+  PhysikalNode node;
+  std::atomic<size_t> received{0};
+  std::atomic<size_t> messages{0}; // reassembled
+  std::atomic<uint64_t> receivedAt{0}; // simMicros() of the last pocket
+};
+
+static Address makeAddress(std::initializer_list<uint16_t> parts)
+{
+  Address address;
+  for (uint16_t part : parts)
+    address.push_back(part);
+  return address;
+}
+
+static void setup(SimNode &n, const char *name, std::initializer_list<uint16_t> you)
+{
+  n.board.name = name;
+  n.node.logicalNode.you = makeAddress(you);
+  n.node.onData = [&n](const Pocket &pocket)
+  {
+    n.receivedAt = hal::simMicros();
+    n.received++;
+    printf("[Sim] %8.3f s  %-8s received '%s'\n", hal::simMicros() / 1e6, n.board.name, pocket.data);
+  };
+  n.node.onMessage = [&n](const char *data, size_t length)
+  {
+    n.messages++;
+    printf("[Sim] %8.3f s  %-8s received a message of %u bytes: '%.20s...'\n", hal::simMicros() / 1e6,
+           n.board.name, (unsigned)length, data);
+  };
+  n.node.onError = [&n](const char *error, const Pocket &)
+  {
+    printf("[Sim] %8.3f s  %-8s error: %s\n", hal::simMicros() / 1e6, n.board.name, error);
+  };
+}
+
+static void link(SimNode &a, uint8_t pinA, SimNode &b, uint8_t pinB, uint8_t lineCode, bool duplex, bool fec)
+{
+  uint8_t txA = duplex ? pinA + SIM_TX_PIN_OFFSET : 0;
+  uint8_t txB = duplex ? pinB + SIM_TX_PIN_OFFSET : 0;
+  a.node.logicalNode.connections.push_back(Connection{b.node.logicalNode.you, pinA, txA});
+  b.node.logicalNode.connections.push_back(Connection{a.node.logicalNode.you, pinB, txB});
+  a.node.logicalNode.connections.back().lineCodeCap = lineCode;
+  b.node.logicalNode.connections.back().lineCodeCap = lineCode;
+  a.node.logicalNode.connections.back().fecCap = fec;
+  b.node.logicalNode.connections.back().fecCap = fec;
+  if (duplex)
+  {
+    hal::sim::connect(a.board, txA, b.board, pinB);
+    hal::sim::connect(b.board, txB, a.board, pinA);
+  }
+  else
+  {
+    hal::sim::connect(a.board, pinA, b.board, pinB);
+  }
+}
+
+static bool negotiated(SimNode (&nodes)[4])
+{
+  for (SimNode &n : nodes)
+  {
+    for (const Connection &c : n.node.logicalNode.connections)
+    {
+      if (c.helloLeft != 0)
+        return false;
+    }
+  }
+  return true;
+}
+
+// bits error correction repaired on every pin
+static uint32_t corrected(SimNode (&nodes)[4])
+{
+  uint32_t bits = 0;
+  for (SimNode &n : nodes)
+  {
+    PinQueueStats stats[MAX_PORTS];
+    size_t count = n.node.queueStats(stats, MAX_PORTS);
+    for (size_t i = 0; i < count; i++)
+      bits += stats[i].corrected;
+  }
+  return bits;
+}
+
+int main(int argc, char **argv)
+{
+  size_t pockets = argc > 1 ? strtoul(argv[1], nullptr, 10) : 4;
+  uint8_t lineCode = argc > 2 && strcmp(argv[2], "nrz") == 0 ? LINE_CODE_NRZ : LINE_CODE_MANCHESTER;
+  int32_t drift = argc > 3 ? strtol(argv[3], nullptr, 10) : 0;
+  uint32_t jitter = argc > 4 ? strtoul(argv[4], nullptr, 10) : 0;
+  size_t messageSize = argc > 5 ? strtoul(argv[5], nullptr, 10) : 1000;
+  double bitErrorRate = argc > 6 ? strtod(argv[6], nullptr) : 0;
+  uint8_t ackWindow = argc > 7 ? strtoul(argv[7], nullptr, 10) : ACK_WINDOW;
+  bool cutThrough = argc > 8 ? strtoul(argv[8], nullptr, 10) != 0 : CUT_THROUGH;
+  bool bundleFrames = argc > 9 ? strtoul(argv[9], nullptr, 10) != 0 : FRAME_BUNDLES;
+  bool duplex = argc > 10 && strtoul(argv[10], nullptr, 10) != 0;
+  bool collisionDetect = argc > 11 ? strtoul(argv[11], nullptr, 10) != 0 : COLLISION_DETECT;
+  uint32_t saturate = argc > 12 ? strtoul(argv[12], nullptr, 10) : 0;
+  bool fec = argc > 13 ? strtoul(argv[13], nullptr, 10) != 0 : FEC_DEFAULT;
+
+  static SimNode nodes[4];
+  SimNode &root = nodes[0], &left = nodes[1], &right = nodes[2], &leaf = nodes[3];
+
+  setup(root, "[1]", {1});
+  setup(left, "[1,1]", {1, 1});
+  setup(right, "[1,2]", {1, 2});
+  setup(leaf, "[1,1,1]", {1, 1, 1});
+
+  link(root, 2, left, 2, lineCode, duplex, fec);
+  link(root, 3, right, 2, lineCode, duplex, fec);
+  link(left, 3, leaf, 2, lineCode, duplex, fec);
+
+  left.board.driftPpm = -drift;
+  right.board.driftPpm = drift;
+  leaf.board.driftPpm = drift;
+
+  for (SimNode &n : nodes)
+  {
+    n.board.jitterUs = jitter;
+    n.node.ackWindow = ackWindow;
+    n.node.cutThrough = cutThrough;
+    n.node.bundleFrames = bundleFrames;
+    n.node.collisionDetect = collisionDetect;
+    hal::sim::BoardScope scope(n.board);
+    n.node.logicalNode.updateRoutes();
+    n.node.start();
+  }
+
+  auto realStart = std::chrono::steady_clock::now();
+
+  while (!negotiated(nodes) && hal::simMicros() < (uint64_t)SIM_NEGOTIATE_TIMEOUT_S * 1000000)
+    hal::delayMs(100);
+
+  for (SimNode &n : nodes)
+  {
+    for (const Connection &c : n.node.logicalNode.connections)
+      printf("[Sim] %8.3f s  %-8s pin %u speaks v%u at %u us per bit, %s%s%s\n", hal::simMicros() / 1e6, n.board.name,
+             c.pin, c.version, (unsigned)c.bitTime(), lineCodeName(c.dataLineCode()), c.duplex() ? ", two-wire" : "",
+             c.fec ? ", error correction" : "");
+  }
+
+  for (SimNode &n : nodes)
+    n.board.flipRate = bitErrorRate;
+
+  std::vector<Pocket> burst;
+  for (size_t i = 0; i < pockets; i++)
+  {
+    char data[DATASIZE + 1];
+    snprintf(data, sizeof(data), "pocket %u", (unsigned)i);
+    burst.push_back(Pocket(right.node.logicalNode.you, data));
+  }
+  uint64_t burstStart = hal::simMicros();
+  size_t queued = leaf.node.sendBatch(burst.data(), burst.size());
+  if (queued < pockets)
+    printf("[Sim] only %u of %u pockets queued\n", (unsigned)queued, (unsigned)pockets);
+
+  while (right.received < pockets && hal::simMicros() < (uint64_t)(pockets + 1) * SIM_TIMEOUT_PER_POCKET_S * 1000000)
+    hal::delayMs(100);
+
+  if (right.received == pockets && pockets > 0)
+    printf("[Sim] burst of %u pockets in %.3f s, %.1f pockets/s, %u bundles of %u pockets\n", (unsigned)pockets,
+           (right.receivedAt - burstStart) / 1e6, pockets / ((right.receivedAt - burstStart) / 1e6),
+           (unsigned)(leaf.node.bundlesSent + left.node.bundlesSent + root.node.bundlesSent),
+           (unsigned)(leaf.node.pocketsBundled + left.node.pocketsBundled + root.node.pocketsBundled));
+
+  std::string message;
+  for (size_t i = 0; message.size() < messageSize; i++)
+    message += "message line " + std::to_string(i) + ". ";
+  message.resize(messageSize);
+
+  size_t expected = messageSize > DATASIZE ? 1 : 0;
+  uint64_t messageStart = hal::simMicros();
+  if (expected > 0)
+  {
+    hal::sim::BoardScope scope(leaf.board);
+    leaf.node.send(right.node.logicalNode.you, message.data(), message.size());
+  }
+
+  while (right.messages < expected && hal::simMicros() - messageStart < (uint64_t)SIM_TIMEOUT_PER_POCKET_S * 1000000)
+    hal::delayMs(100);
+
+  if (right.messages > 0)
+    printf("[Sim] message goodput %.1f bytes/s, %u retransmissions, %u frames relayed, %u cut off, %u bits corrected\n",
+           messageSize / ((hal::simMicros() - messageStart) / 1e6),
+           (unsigned)(leaf.node.retransmits + left.node.retransmits + root.node.retransmits),
+           (unsigned)(left.node.relayed + root.node.relayed), (unsigned)(left.node.relaysCut + root.node.relaysCut),
+           (unsigned)corrected(nodes));
+
+  size_t delivered = right.received;
+
+  if (saturate > 0)
+  {
+    struct End
+    {
+      SimNode &from, &to;
+      uint8_t pin;
+    } ends[] = {{root, right, 3}, {right, root, 2}};
+
+    size_t before = root.received + right.received;
+    uint64_t start = hal::simMicros();
+    while (hal::simMicros() - start < (uint64_t)saturate * 1000000)
+    {
+      for (End &end : ends)
+      {
+        hal::sim::BoardScope scope(end.from.board);
+        while (end.from.node.pinBacklog[end.pin] < PIN_CONTROL_QUEUE_SIZE)
+        {
+          Pocket p(end.to.node.logicalNode.you, "saturate");
+          if (end.from.node.sendBatch(&p, 1) == 0)
+            break;
+        }
+      }
+      hal::delayMs(2);
+    }
+
+    uint32_t collisions = 0, deferrals = 0;
+    for (End &end : ends)
+    {
+      PinQueueStats stats[MAX_PORTS];
+      size_t n = end.from.node.queueStats(stats, MAX_PORTS);
+      for (size_t i = 0; i < n; i++)
+      {
+        collisions += stats[i].collisions;
+        deferrals += stats[i].deferrals;
+      }
+    }
+    printf("[Sim] [1] - [1,2] saturated for %u s: %.1f pockets/s, %u collisions, %u frames held back\n",
+           (unsigned)saturate, (root.received + right.received - before) / (double)saturate, (unsigned)collisions,
+           (unsigned)deferrals);
+  }
+
+  double simSeconds = hal::simMicros() / 1e6;
+  double realSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - realStart).count();
+
+  for (SimNode &n : nodes)
+  {
+    hal::sim::BoardScope scope(n.board);
+    n.node.stop();
+  }
+
+  printf("[Sim] delivered %u/%u pockets and %u/%u messages in %.3f s simulated, %.3f s real\n",
+         (unsigned)delivered, (unsigned)pockets, (unsigned)right.messages.load(), (unsigned)expected,
+         simSeconds, realSeconds);
+
+  return delivered == pockets && right.messages == expected ? 0 : 1;
+}
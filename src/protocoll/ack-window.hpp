@@ -0,0 +1,162 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "./frame.hpp"
+
+#ifndef ACK_WINDOW
+#define ACK_WINDOW 4 // pockets sent and not acknowledged per connection, 1 = stop and wait
+#endif
+#define ACK_WINDOW_MAX 8 // largest window PhysikalNode::ackWindow may be set to
+#define ACK_BATCH 8            // ids per acknowledgement frame
+#define ACK_SLOT_MARGIN_US 2000 // on top of the turnaround and a bit time, see sent()
+
+#define RESEND_TIMEOUT 5000 // milliseconds, until the round trip of a connection is measured
+#define RESEND_MIN_US 5000
+#define MAX_ATTEMPTS 50 // transmissions of a pocket before it is given up
+
+// Hop by hop acknowledgements of a v5 connection, kept by the PhysLoop task
+// per port. The receiver of a data frame answers with an acknowledgement
+// frame (FRAME_ACK, the payload lists the ids) once the line turned around.
+// Sent pockets wait here for it, up to the window size of them, so a lost
+// frame doesn't stop the ones behind it. A pocket is sent again once its
+// timeout passed, the timeout follows the measured round trip (smoothed
+// mean plus four mean deviations, samples only from pockets sent once) and
+// doubles with every attempt, up to RESEND_TIMEOUT.
+struct AckWindow
+{
+  struct Outstanding
+  {
+    SendRequest *req;
+    uint32_t sentAt; // micros() after the last bit
+  };
+
+  Outstanding unacked[ACK_WINDOW_MAX]; // oldest first
+  uint8_t count = 0;
+  uint16_t pending[ACK_BATCH];     // ids received and still to acknowledge
+  uint8_t pendingCount = 0;
+  uint16_t early[FRAME_BUNDLE_MAX]; // acknowledged while still being sent
+  uint8_t earlyCount = 0;
+  uint32_t slotUntil = 0; // the peer may start its acknowledgement until then
+  uint32_t srtt = 0;      // us, 0 until the first sample
+  uint32_t rttvar = 0;
+
+  ~AckWindow()
+  {
+    for (uint8_t i = 0; i < count; i++)
+      delete unacked[i].req;
+  }
+
+  bool full(uint8_t window) const { return count >= (window < ACK_WINDOW_MAX ? window : ACK_WINDOW_MAX); }
+
+  // of a pocket sent attempts times
+  uint32_t timeout(uint8_t attempts = 1) const
+  {
+    if (srtt == 0)
+      return RESEND_TIMEOUT * 1000u;
+    uint32_t rto = srtt + 4 * rttvar;
+    if (rto < RESEND_MIN_US)
+      rto = RESEND_MIN_US;
+    for (uint8_t i = 1; i < attempts && rto < RESEND_TIMEOUT * 1000u; i++)
+      rto *= 2;
+    return rto < RESEND_TIMEOUT * 1000u ? rto : RESEND_TIMEOUT * 1000u;
+  }
+
+  // our next data frame waits for the acknowledgement of the last one
+  bool slotOpen(uint32_t now) const { return (int32_t)(now - slotUntil) >= 0; }
+
+  // req was just sent, its acknowledgement starts a turnaround after the
+  // frame once the peer decoded it, within half a bit time and a pass of
+  // its loop. False if it came already (see acknowledgedEarly), req is
+  // done then.
+  bool sent(SendRequest *req, uint32_t now, uint32_t bitTime)
+  {
+    slotUntil = now + FRAME_TURNAROUND_US + bitTime + ACK_SLOT_MARGIN_US;
+    for (uint8_t i = 0; i < earlyCount; i++)
+    {
+      if (early[i] == req->pocket.id)
+      {
+        early[i] = early[--earlyCount];
+        return false;
+      }
+    }
+
+    // full(window) kept new pockets out, a retransmission took its place
+    unacked[count++] = Outstanding{req, now};
+    return true;
+  }
+
+  // A two-wire peer acknowledges the first pockets of a bundle while the
+  // rest is still on our line, before sent() took them.
+  void acknowledgedEarly(uint16_t id)
+  {
+    if (earlyCount < FRAME_BUNDLE_MAX)
+      early[earlyCount++] = id;
+  }
+
+  // the outstanding pocket with this id, nullptr if there is none
+  SendRequest *take(uint16_t id, uint32_t now)
+  {
+    for (uint8_t i = 0; i < count; i++)
+    {
+      if (unacked[i].req->pocket.id != id)
+        continue;
+
+      SendRequest *req = unacked[i].req;
+      if (req->attempts == 1)
+        sample(now - unacked[i].sentAt);
+      erase(i);
+      return req;
+    }
+    return nullptr;
+  }
+
+  // oldest pocket whose timeout passed, taken out of the window
+  SendRequest *due(uint32_t now)
+  {
+    for (uint8_t i = 0; i < count; i++)
+    {
+      if (now - unacked[i].sentAt < timeout(unacked[i].req->attempts))
+        continue;
+
+      SendRequest *req = unacked[i].req;
+      erase(i);
+      return req;
+    }
+    return nullptr;
+  }
+
+  // a copy that arrives again is acknowledged again, its first
+  // acknowledgement may have been lost
+  void expect(uint16_t id)
+  {
+    for (uint8_t i = 0; i < pendingCount; i++)
+    {
+      if (pending[i] == id)
+        return;
+    }
+    if (pendingCount < ACK_BATCH)
+      pending[pendingCount++] = id;
+  }
+
+private:
+  void erase(uint8_t i)
+  {
+    for (count--; i < count; i++)
+      unacked[i] = unacked[i + 1];
+  }
+
+  void sample(uint32_t rtt)
+  {
+    if (srtt == 0)
+    {
+      srtt = rtt;
+      rttvar = rtt / 2;
+      return;
+    }
+    uint32_t delta = rtt > srtt ? rtt - srtt : srtt - rtt;
+    rttvar = (3 * rttvar + delta) / 4;
+    srtt = (7 * srtt + rtt) / 8;
+  }
+};
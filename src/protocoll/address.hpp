@@ -0,0 +1,134 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// deepest address a node can hold, elements beyond are rejected
+#ifndef ADDRESS_MAX_DEPTH
+#define ADDRESS_MAX_DEPTH 16
+#endif
+
+// Address with inline storage, copying or building one never touches the heap.
+struct Address
+{
+  uint16_t items[ADDRESS_MAX_DEPTH] = {}; // zeroed, commonPrefix reads past length
+  uint8_t length = 0;
+
+  size_t size() const { return length; }
+  bool empty() const { return length == 0; }
+  bool full() const { return length == ADDRESS_MAX_DEPTH; }
+  void clear() { length = 0; }
+
+  // false if the address is already ADDRESS_MAX_DEPTH deep
+  bool push_back(uint16_t value)
+  {
+    if (full())
+      return false;
+    items[length++] = value;
+    return true;
+  }
+
+  void pop_back()
+  {
+    if (length > 0)
+      length--;
+  }
+
+  uint16_t &operator[](size_t i) { return items[i]; }
+  const uint16_t &operator[](size_t i) const { return items[i]; }
+
+  uint16_t *begin() { return items; }
+  uint16_t *end() { return items + length; }
+  const uint16_t *begin() const { return items; }
+  const uint16_t *end() const { return items + length; }
+};
+
+// Number of equal leading elements of a and b (n elements each).
+//
+// Host builds compare 8 elements per step with SSE2/NEON or 4 per 64-bit
+// word and locate the first difference with count trailing zeros. The esp32
+// keeps the plain loop: it is a 32-bit core without a ctz instruction and
+// addresses are a handful of elements deep.
+inline size_t commonPrefix(const uint16_t *a, const uint16_t *b, size_t n)
+{
+  size_t i = 0;
+
+#if !defined(ARDUINO)
+#if defined(__SSE2__)
+  for (; i + 8 <= n; i += 8)
+  {
+    __m128i equal = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i *)(a + i)),
+                                    _mm_loadu_si128((const __m128i *)(b + i)));
+    unsigned diff = ~_mm_movemask_epi8(equal) & 0xFFFF; // 2 bits per element
+    if (diff)
+      return i + __builtin_ctz(diff) / 2;
+  }
+#elif defined(__ARM_NEON)
+  for (; i + 8 <= n; i += 8)
+  {
+    uint16x8_t equal = vceqq_u16(vld1q_u16(a + i), vld1q_u16(b + i));
+    uint64_t diff = ~vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(equal, 4)), 0); // 8 bits per element
+    if (diff)
+      return i + __builtin_ctzll(diff) / 8;
+  }
+#endif
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  for (; i + 4 <= n; i += 4)
+  {
+    uint64_t x, y;
+    memcpy(&x, a + i, sizeof(x));
+    memcpy(&y, b + i, sizeof(y));
+    if (x != y)
+      return i + __builtin_ctzll(x ^ y) / 16;
+  }
+#endif
+#endif
+
+  while (i < n && a[i] == b[i])
+    i++;
+  return i;
+}
+
+// commonPrefix of the first n elements of two addresses (n <= both sizes).
+//
+// The inline storage is always ADDRESS_MAX_DEPTH elements, so host builds
+// compare whole padded words and mask off everything past n instead of
+// stepping up to n: one 8 element step for the usual shallow address, where
+// the stepping commonPrefix above costs more than the plain loop. A single
+// element is compared directly.
+inline size_t commonPrefix(const Address &a, const Address &b, size_t n)
+{
+#if !defined(ARDUINO) && (defined(__SSE2__) || defined(__ARM_NEON)) && ADDRESS_MAX_DEPTH % 8 == 0
+  if (n <= 1)
+    return n == 1 && a.items[0] == b.items[0];
+
+  for (size_t i = 0; i < n; i += 8)
+  {
+#if defined(__SSE2__)
+    __m128i equal = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i *)(a.items + i)),
+                                    _mm_loadu_si128((const __m128i *)(b.items + i)));
+    uint32_t diff = ~_mm_movemask_epi8(equal) & 0xFFFF; // 2 bits per element
+    const size_t bits = 2;
+#else
+    uint16x8_t equal = vceqq_u16(vld1q_u16(a.items + i), vld1q_u16(b.items + i));
+    uint64_t diff = ~vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(equal, 4)), 0); // 8 bits per element
+    const size_t bits = 8;
+#endif
+    if (n - i < 8)
+      diff |= (decltype(diff))1 << (bits * (n - i)); // stop at n
+    if (diff)
+      return i + __builtin_ctzll(diff) / bits;
+  }
+  return n;
+#else
+  return commonPrefix(a.items, b.items, n);
+#endif
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "../hal/index.hpp"
+
+#ifndef COLLISION_DETECT
+#define COLLISION_DETECT true // default of PhysikalNode::collisionDetect
+#endif
+#define COLLISION_READS 2           // HIGH read in a row while we drive LOW, see PinTransmitter::advance
+#define COLLISION_SLOT_US 1000      // a pass of the PhysLoop task, a bit time is added
+#define COLLISION_BACKOFF_MAX_EXP 6 // at most 2^6 - 1 slots
+
+// Randomized exponential backoff of one shared wire. After the nth
+// collision in a row none of our frames starts for 0 to 2^n - 1 slots,
+// chosen at random, so the two ends that collided pick different slots
+// sooner or later. A slot is long enough for the end that waits to see the
+// carrier of the one that goes first.
+struct CollisionBackoff
+{
+  uint32_t until = 0;
+  uint8_t inRow = 0;
+  volatile uint32_t collisions = 0; // frames of ours that collided
+  volatile uint32_t deferrals = 0;  // frames held back, the peer had just begun
+
+  bool over(uint32_t now) const { return (int32_t)(now - until) >= 0; }
+
+  void collided(uint32_t now, uint32_t bitTime)
+  {
+    collisions++;
+    if (inRow < COLLISION_BACKOFF_MAX_EXP)
+      inRow++;
+    until = now + hal::random(1L << inRow) * (COLLISION_SLOT_US + bitTime);
+  }
+
+  // a frame went out whole
+  void sent() { inRow = 0; }
+};
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "./address.hpp"
+
+#ifndef DUPLICATE_CAPACITY
+#define DUPLICATE_CAPACITY 64 // pockets remembered per node, a power of two
+#endif
+#define DUPLICATE_EXPIRY_MS 30000 // a pocket id can be used again after this
+
+// Pockets a node received lately, to drop copies that arrive over a second
+// path or as a resend. Frames carry no source address, so a pocket is known
+// by its destination address and id. Open addressing with linear probing,
+// entries older than DUPLICATE_EXPIRY_MS count as free. Once the table is
+// 3/4 full the expired entries are removed, if none is expired the one
+// remembered first goes.
+struct DuplicateFilter
+{
+  struct Entry
+  {
+    uint32_t key; // 0 = free
+    uint32_t seenMs;
+    uint32_t order; // of insertion
+  };
+
+  Entry entries[DUPLICATE_CAPACITY] = {};
+  size_t count = 0;        // used entries, expired ones included
+  uint32_t inserted = 0;
+  volatile uint32_t duplicates = 0; // pockets recognized
+  volatile uint32_t evicted = 0;    // forgotten before they expired
+
+  // true if this pocket was seen within DUPLICATE_EXPIRY_MS, remembers it
+  // otherwise if remember is set
+  bool seen(const Address &address, uint16_t id, uint32_t nowMs, bool remember = true)
+  {
+    uint32_t k = key(address, id);
+    size_t reuse = DUPLICATE_CAPACITY;
+
+    for (size_t i = slot(k);; i = (i + 1) % DUPLICATE_CAPACITY)
+    {
+      Entry &e = entries[i];
+      if (e.key == 0)
+        break;
+
+      bool expired = nowMs - e.seenMs > DUPLICATE_EXPIRY_MS;
+      if (e.key == k && !expired)
+      {
+        duplicates++;
+        return true;
+      }
+      if (e.key == k || (expired && reuse == DUPLICATE_CAPACITY))
+        reuse = i;
+    }
+
+    if (!remember)
+      return false;
+
+    if (reuse == DUPLICATE_CAPACITY)
+    {
+      if (count + 1 > DUPLICATE_CAPACITY * 3 / 4)
+        makeRoom(nowMs);
+      reuse = slot(k);
+      while (entries[reuse].key != 0)
+        reuse = (reuse + 1) % DUPLICATE_CAPACITY;
+      count++;
+    }
+
+    entries[reuse].key = k;
+    entries[reuse].seenMs = nowMs;
+    entries[reuse].order = inserted++;
+    return false;
+  }
+
+private:
+  static uint32_t key(const Address &address, uint16_t id)
+  {
+    // FNV-1a of the address in the high half
+    uint32_t h = 2166136261u;
+    for (uint16_t part : address)
+    {
+      h = (h ^ (part & 0xFF)) * 16777619u;
+      h = (h ^ (part >> 8)) * 16777619u;
+    }
+    uint32_t k = (h & 0xFFFF0000u) | id;
+    return k != 0 ? k : 1;
+  }
+
+  static size_t slot(uint32_t k)
+  {
+    k ^= k >> 16;
+    k *= 0x45D9F3Bu;
+    k ^= k >> 16;
+    return k % DUPLICATE_CAPACITY;
+  }
+
+  void makeRoom(uint32_t nowMs)
+  {
+    size_t oldest = DUPLICATE_CAPACITY;
+    for (size_t i = 0; i < DUPLICATE_CAPACITY;)
+    {
+      Entry &e = entries[i];
+      if (e.key != 0 && nowMs - e.seenMs > DUPLICATE_EXPIRY_MS)
+      {
+        erase(i); // an entry may have moved into i, look again
+        continue;
+      }
+      i++;
+    }
+
+    if (count + 1 <= DUPLICATE_CAPACITY * 3 / 4)
+      return;
+
+    for (size_t i = 0; i < DUPLICATE_CAPACITY; i++)
+    {
+      if (entries[i].key != 0 &&
+          (oldest == DUPLICATE_CAPACITY || inserted - entries[i].order > inserted - entries[oldest].order))
+        oldest = i;
+    }
+    erase(oldest);
+    evicted++;
+  }
+
+  // removes entry i and moves later entries of its probe chain up
+  void erase(size_t i)
+  {
+    entries[i].key = 0;
+    count--;
+
+    for (size_t j = (i + 1) % DUPLICATE_CAPACITY; entries[j].key != 0; j = (j + 1) % DUPLICATE_CAPACITY)
+    {
+      size_t home = slot(entries[j].key);
+      // j stays if its home lies cyclically in (i, j]
+      bool stays = i <= j ? (i < home && home <= j) : (i < home || home <= j);
+      if (stays)
+        continue;
+
+      entries[i] = entries[j];
+      entries[j].key = 0;
+      i = j;
+    }
+  }
+};
@@ -0,0 +1,315 @@
+#pragma once
+
+#include "../hal/index.hpp"
+#include "./frame-decoder.hpp"
+#include "./logical.hpp"
+#include "./pin-transmitter.hpp"
+
+#define EDGE_BUFFER_SIZE 256 // edges kept per pin until the PhysLoop task decodes them
+#define EDGE_SETTLE_US 200   // an edge older than this is certainly in the buffer
+
+// Level changes of one pin, written by its edge interrupt and read by the
+// PhysLoop task. Each entry is the micros() of the edge with the new level
+// in bit 0.
+struct EdgeCapture
+{
+  uint8_t pin;
+  volatile bool paused = false; // we drive the line ourselves
+  volatile bool overflow = false;
+  volatile uint16_t head = 0;
+  volatile uint16_t tail = 0;
+  uint32_t edges[EDGE_BUFFER_SIZE];
+
+  explicit EdgeCapture(uint8_t pin_) : pin(pin_) {}
+
+  static void HAL_ISR_ATTR onEdge(void *arg)
+  {
+    EdgeCapture *capture = static_cast<EdgeCapture *>(arg);
+    if (capture->paused)
+      return;
+
+    uint16_t next = (capture->head + 1) % EDGE_BUFFER_SIZE;
+    if (next == capture->tail)
+    {
+      capture->overflow = true;
+      return;
+    }
+    capture->edges[capture->head] = (hal::micros() & ~1u) | (hal::digitalRead(capture->pin) ? 1 : 0);
+    capture->head = next;
+  }
+
+  bool peek(uint32_t &edge) const
+  {
+    if (tail == head)
+      return false;
+    edge = edges[tail];
+    return true;
+  }
+
+  void drop() { tail = (tail + 1) % EDGE_BUFFER_SIZE; }
+
+  void clear()
+  {
+    tail = head;
+    overflow = false;
+  }
+};
+
+// Receive side of one connection. Bits are recovered from the captured edge
+// timestamps (NRZ: the level in the middle of each bit time, Manchester: the
+// direction of the transition in the middle of each bit), so frames keep
+// arriving while the PhysLoop task is busy and several pins receive at once.
+// The bits of a frame are kept as they arrive and handed on to its relay,
+// if it is sent on before it is complete (see PinTransmitter). Data frames
+// of a connection with error correction are repaired before the decoder
+// gets them (see fec.hpp).
+struct PinReceiver
+{
+  EdgeCapture capture;
+  FrameDecoder frame;
+  FecDecoder fecBits;
+  FrameBits bits;             // of the frame in progress, start bit included
+  uint32_t wireBits = 0;      // of the frame in progress, also those past the end of bits
+  SendRequest *req = nullptr; // frame in progress, decoded in place
+  PinTransmitter *relay = nullptr;
+  bool relayChecked = false; // the frame in progress was routed for a relay
+  uint32_t frameStart = 0;
+  uint32_t bitTime = 0; // of the frame in progress, 0 until it is known
+  uint32_t lastMid = 0; // Manchester, edge in the middle of the last bit
+  uint32_t quietUntil = 0; // no frame of ours starts before
+  bool level = false;
+  bool fec = false; // the frame in progress carries error correction
+  volatile uint32_t corrected = 0; // bits repaired so far
+  uint8_t tooFast = 0;             // frames faster than the connection, dropped
+  bool skipping = false;           // edges of such a frame until skipUntil
+  uint32_t skipUntil = 0;
+  TraceRing *trace = nullptr;      // set by the PhysikalNode
+
+  explicit PinReceiver(uint8_t pin) : capture(pin) {}
+  ~PinReceiver() { reset(); }
+
+  uint8_t pin() const { return capture.pin; }
+
+  // no frame in progress or waiting to be decoded
+  bool idle() const { return req == nullptr && capture.tail == capture.head; }
+
+  bool settled(uint32_t now) const { return (int32_t)(now - quietUntil) >= 0; }
+
+  // micros() right after the last bit of the completed frame
+  uint32_t frameEnd() const { return frameStart + wireBits * bitTime; }
+
+  // Decodes every bit that is already on the wire, data frames as conn
+  // sends them. True once a frame (or a pocket of a bundle) is complete, the
+  // caller then takes req.
+  bool poll(uint32_t now, const Connection &conn)
+  {
+    uint32_t dataBitTime = conn.bitTime();
+
+    if (capture.overflow)
+    {
+      LOG_DEBUG("[Protocol] receiver: edge buffer overflow on pin %u", pin());
+      if (trace)
+        trace->record(TRACE_EDGE_OVERFLOW, pin(), 0);
+      reset();
+    }
+
+    uint32_t edge;
+    while (true)
+    {
+      if (req == nullptr && frame.more())
+      {
+        // the next pocket of a bundle
+        req = new (POOL_RECEIVE) SendRequest();
+        if (req == nullptr)
+        {
+          reset();
+          return false;
+        }
+        frame.next(&req->pocket);
+        continue;
+      }
+
+      if (req == nullptr)
+      {
+        // idle, a rising edge starts the next frame
+        if (!capture.peek(edge))
+          return false;
+        capture.drop();
+        level = edge & 1;
+        if (skipping && (int32_t)((edge & ~1u) - skipUntil) < 0)
+        {
+          skipUntil = (edge & ~1u) + BIT_DELAY;
+          continue;
+        }
+        skipping = false;
+        if (!level)
+          continue;
+
+        req = new (POOL_RECEIVE) SendRequest();
+        if (req == nullptr)
+        {
+          // the pocket pool ran dry, the frame is lost
+          reset();
+          return false;
+        }
+        frameStart = edge & ~1u;
+        bitTime = 0;
+        frame.begin(&req->pocket, conn.version);
+        fec = conn.fec;
+        fecBits.clear();
+        bits.clear();
+        bits.push(1);
+        wireBits = 1;
+        relayChecked = false;
+        continue;
+      }
+
+      if (bitTime == 0)
+      {
+        // a fast data frame starts with a pulse of two or three of its bits
+        // (half a bit in Manchester), a management frame with one BIT_DELAY
+        // (see frame.hpp)
+        uint32_t limit = BIT_DELAY * 3 / 4;
+        bool fast = false;
+        if (capture.peek(edge))
+          fast = (edge & ~1u) - frameStart < limit;
+        else if ((int32_t)(now - frameStart) < (int32_t)(limit + EDGE_SETTLE_US))
+          return false;
+        bitTime = fast ? dataBitTime : BIT_DELAY;
+
+        // the peer settled on a faster rate than this connection, the rest
+        // of its frame is skipped
+        if (fast && dataBitTime >= BIT_DELAY)
+        {
+          LOG_DEBUG("[Protocol] receiver: frame on pin %u faster than its connection", pin());
+          if (trace)
+            trace->record(TRACE_UNKNOWN_VERSION, pin(), 0);
+          tooFast++;
+          reset();
+          skipping = true;
+          skipUntil = frameStart + BIT_DELAY;
+          continue;
+        }
+
+        // Manchester: the rising edge was the middle of the start bit
+        lastMid = frameStart;
+      }
+
+      if (bitTime != BIT_DELAY && conn.dataLineCode() == LINE_CODE_MANCHESTER)
+      {
+        if (pollManchester(now))
+          return true;
+        if (req == nullptr)
+          continue;
+        return false;
+      }
+
+      uint32_t sampleAt = frameStart + wireBits * bitTime + bitTime / 2;
+      if ((int32_t)(now - sampleAt) < EDGE_SETTLE_US)
+        return false;
+
+      while (capture.peek(edge) && (int32_t)(sampleAt - (edge & ~1u)) >= 0)
+      {
+        level = edge & 1;
+        capture.drop();
+      }
+
+      if (pushBit(level))
+        return true;
+    }
+  }
+
+  // Every bit has a transition in its middle, one between two bits only if
+  // they are equal. An edge less than 3/4 bit time after the last middle is
+  // such a bit boundary, every other one is the middle of the next bit and
+  // resynchronizes the bit clock.
+  bool pollManchester(uint32_t now)
+  {
+    uint32_t edge;
+    while (capture.peek(edge))
+    {
+      uint32_t at = edge & ~1u;
+      capture.drop();
+      if (at - lastMid < bitTime * 3 / 4)
+        continue;
+
+      lastMid = at;
+      if (pushBit(edge & 1))
+        return true;
+    }
+
+    // the sender stopped within the frame
+    if ((int32_t)(now - lastMid) > (int32_t)(bitTime * 2 + EDGE_SETTLE_US))
+    {
+      LOG_DEBUG("[Protocol] receiver: Manchester frame on pin %u broke off", pin());
+      if (trace)
+        trace->record(TRACE_BROKE_OFF, pin(), 0);
+      reset();
+    }
+    return false;
+  }
+
+  bool pushBit(bool bit)
+  {
+    wireBits++;
+    if (bits.count < FEC_WIRE_BITS(FRAME_MAX_BITS)) // a broken bundle may run longer, bundles are never relayed
+      bits.push(bit);
+    if (relay != nullptr)
+      relay->feed(bit);
+    if (!fec || !frame.isData || frame.bits < FEC_PLAIN_BITS)
+      return frame.pushBit(bit);
+
+    // frames and pockets of a bundle end with a whole byte
+    if (!fecBits.push(bit))
+      return false;
+    uint8_t value = fecBits.value();
+    corrected += fecBits.corrected;
+    bool complete = false;
+    for (int i = 7; i >= 0; i--)
+      complete = frame.pushBit(value >> i & 1);
+    return complete;
+  }
+
+  // a data frame to route before it is complete
+  bool relayDue() const { return req != nullptr && frame.routable && !relayChecked; }
+
+  // the relay of the completed frame once all of it is fed, nullptr if
+  // there is none or it was cut off already
+  PinTransmitter *takeRelay()
+  {
+    PinTransmitter *tx = relay;
+    if (tx == nullptr)
+      return nullptr;
+    relay = nullptr;
+    tx->endRelay();
+    return tx->busy && !tx->cut ? tx : nullptr;
+  }
+
+  // stop capturing while we drive the line
+  void pause() { capture.paused = true; }
+
+  // after a management exchange the peer listens again up to a bit time
+  // after us, quietUs keeps our next frame off the line until then
+  void resume(uint32_t quietUs = 0)
+  {
+    reset();
+    quietUntil = hal::micros() + quietUs;
+    capture.paused = false;
+  }
+
+  void reset()
+  {
+    // the frame broke off, so does its relay
+    if (relay != nullptr)
+    {
+      relay->abort();
+      relay->source = nullptr;
+      relay = nullptr;
+    }
+    delete req;
+    req = nullptr;
+    frame.cancel();
+    capture.clear();
+    level = false;
+  }
+};
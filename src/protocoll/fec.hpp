@@ -0,0 +1,80 @@
+#pragma once
+
+#include <stdint.h>
+
+#ifndef FEC_DEFAULT
+#define FEC_DEFAULT false // default of Connection::fecCap
+#endif
+#define FEC_PLAIN_BITS 10 // start, type and header bit, sent as they are
+#define FEC_BYTE_BITS 14  // wire bits of every later byte
+
+// wire bits of a data frame of bits bits with forward error correction
+#define FEC_WIRE_BITS(bits) (FEC_PLAIN_BITS + ((bits) - FEC_PLAIN_BITS) / 8 * FEC_BYTE_BITS)
+
+// Forward error correction of the data frames of a connection, agreed by the
+// hello (see send-hello.hpp). Every byte after the header byte goes on the
+// wire as two Hamming(7,4) code words, one per nibble, each the four data
+// bits followed by three parity bits. Their bits alternate, so a code word
+// loses at most one bit to an error burst of two and the receiver repairs
+// it. The header byte stays plain: its first two bits keep the first pulse
+// of the frame short (see frame.hpp).
+
+// code word of the 4 bit nibble, first bit in bit 6
+inline uint8_t hammingEncode(uint8_t nibble)
+{
+  uint8_t d1 = nibble >> 3 & 1, d2 = nibble >> 2 & 1, d3 = nibble >> 1 & 1, d4 = nibble & 1;
+  return nibble << 3 | (d1 ^ d2 ^ d4) << 2 | (d1 ^ d3 ^ d4) << 1 | (d2 ^ d3 ^ d4);
+}
+
+// nibble of a received code word, corrected is set if a bit was wrong
+inline uint8_t hammingDecode(uint8_t word, bool &corrected)
+{
+  // the bit a syndrome points at: p3, p2, d3, p1, d2, d1, d4
+  static const uint8_t flips[8] = {0x00, 0x01, 0x02, 0x10, 0x04, 0x20, 0x40, 0x08};
+  uint8_t syndrome = (hammingEncode(word >> 3) ^ word) & 0x07;
+  corrected = syndrome != 0;
+  return (word ^ flips[syndrome]) >> 3;
+}
+
+// the two interleaved code words of value, first bit in bit 13
+inline uint16_t fecEncodeByte(uint8_t value)
+{
+  uint8_t high = hammingEncode(value >> 4);
+  uint8_t low = hammingEncode(value & 0x0F);
+  uint16_t bits = 0;
+  for (int i = 6; i >= 0; i--)
+    bits = bits << 2 | (high >> i & 1) << 1 | (low >> i & 1);
+  return bits;
+}
+
+// Receive side, gathers the wire bits of one byte
+struct FecDecoder
+{
+  uint16_t bits = 0;
+  uint8_t count = 0;
+  uint8_t corrected = 0; // bits repaired in the last byte
+
+  void clear() { bits = count = 0; }
+
+  // true once a byte is complete, value() returns it
+  bool push(bool bit)
+  {
+    bits = bits << 1 | bit;
+    return ++count == FEC_BYTE_BITS;
+  }
+
+  uint8_t value()
+  {
+    uint8_t high = 0, low = 0;
+    for (int i = FEC_BYTE_BITS - 1; i > 0; i -= 2)
+    {
+      high = high << 1 | (bits >> i & 1);
+      low = low << 1 | (bits >> (i - 1) & 1);
+    }
+    bool highFixed, lowFixed;
+    uint8_t value = hammingDecode(high, highFixed) << 4 | hammingDecode(low, lowFixed);
+    corrected = highFixed + lowFixed;
+    clear();
+    return value;
+  }
+};
@@ -0,0 +1,301 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "./frame.hpp"
+
+enum FrameStep
+{
+  FRAME_STEP_TYPE,
+  FRAME_STEP_MANAGEMENT_TYPE,
+  FRAME_STEP_ADDRESS,
+  FRAME_STEP_HEADER,
+  FRAME_STEP_VARINT_ADDRESS,
+  FRAME_STEP_BUNDLED_HEADER,
+  FRAME_STEP_LENGTH,
+  FRAME_STEP_FRAGMENT,
+  FRAME_STEP_FRAGMENTS,
+  FRAME_STEP_DATA,
+  FRAME_STEP_ID,
+  FRAME_STEP_CHECKSUM,
+  FRAME_STEP_NEXT, // of a bundle, see next()
+  FRAME_STEP_DONE
+};
+
+// Incremental parser of one frame, fed one bit at a time after the start
+// bit. Data frames are decoded into *pocket, management frames only fill in
+// its address (connect request). A bundle is decoded pocket by pocket,
+// pushBit returns true after each, more() tells if another follows.
+struct FrameDecoder
+{
+  Pocket *pocket = nullptr;
+  uint8_t version = FRAME_VERSION_1; // of data frames on this connection
+  bool isData = false;
+  bool connectRequest = false;
+  bool tooDeep = false;
+  bool tooLong = false;
+  uint16_t overflow[2]; // connect request elements past ADDRESS_MAX_DEPTH, see pushElement
+  uint8_t overflowCount = 0;
+  bool ack = false; // v5 acknowledgement, the payload holds the ids
+  bool knownVersion = true;
+  bool routable = false; // data frame, address and length are in
+  bool bundle = false;
+  uint32_t checksum = 0; // as received
+  FrameCrc crc;          // v4, of the bytes before the checksum
+  size_t bits = 0;       // consumed so far, start bit included
+
+  void begin(Pocket *target, uint8_t frameVersion)
+  {
+    pocket = target;
+    version = frameVersion;
+    isData = connectRequest = ack = routable = bundle = false;
+    knownVersion = true;
+    overflowCount = 0;
+    bits = 1;
+    step = FRAME_STEP_TYPE;
+    byte = bitCount = 0;
+    beginPocket();
+  }
+
+  // a bundle continues with another pocket
+  bool more() const { return step == FRAME_STEP_NEXT; }
+
+  // the next pocket of the bundle goes into *target
+  void next(Pocket *target)
+  {
+    pocket = target;
+    beginPocket();
+    step = FRAME_STEP_BUNDLED_HEADER;
+  }
+
+  // the frame was given up
+  void cancel() { step = FRAME_STEP_DONE; }
+
+  // of a complete data frame, checksum against what arrived
+  bool checksumOk() const
+  {
+    if (version >= FRAME_VERSION_4)
+      return checksum == crc.value();
+    return checksum == pocket->calculateChecksum();
+  }
+
+  // true once the frame, or a pocket of a bundle, is complete
+  bool pushBit(bool bit)
+  {
+    bits++;
+
+    if (step == FRAME_STEP_TYPE)
+    {
+      isData = bit;
+      if (!isData)
+        step = FRAME_STEP_MANAGEMENT_TYPE;
+      else
+        step = version >= FRAME_VERSION_2 ? FRAME_STEP_HEADER : FRAME_STEP_ADDRESS;
+      return false;
+    }
+
+    if (step == FRAME_STEP_MANAGEMENT_TYPE)
+    {
+      connectRequest = bit;
+      step = connectRequest ? FRAME_STEP_ADDRESS : FRAME_STEP_DONE;
+      return step == FRAME_STEP_DONE;
+    }
+
+    byte = (byte << 1) | bit;
+    if (++bitCount < 8)
+      return false;
+
+    pushByte(byte);
+    byte = bitCount = 0;
+    return step == FRAME_STEP_DONE || step == FRAME_STEP_NEXT;
+  }
+
+private:
+  uint8_t step = FRAME_STEP_DONE;
+  uint8_t byte = 0;
+  uint8_t bitCount = 0;
+  uint32_t word = 0; // uint16 or varint being assembled
+  uint8_t shift = 0;
+  uint8_t count = 0;  // address elements or data bytes so far
+  uint8_t length = 0; // of the address
+  uint8_t bundleLeft = 0; // pockets of the bundle after this one
+  Address lastAddress;    // of the pocket before in the bundle
+
+  void beginPocket()
+  {
+    tooDeep = tooLong = false;
+    checksum = 0;
+    // CRC kind is known once the length byte is in, until then both run
+    crc.begin(version >= FRAME_VERSION_4 ? CRC_16 | CRC_32 : 0);
+    word = 0;
+    shift = 0;
+    count = length = 0;
+    pocket->length = pocket->fragment = pocket->fragments = 0;
+  }
+
+  // after the address
+  FrameStep dataStep()
+  {
+    if (version >= FRAME_VERSION_3)
+      return FRAME_STEP_LENGTH;
+
+    routable = true;
+    pocket->length = FRAME_FIXED_DATASIZE;
+    return FRAME_STEP_DATA;
+  }
+
+  // data bytes left, or on to the id
+  FrameStep payloadStep()
+  {
+    pocket->data[count] = '\0';
+    return count < pocket->length ? FRAME_STEP_DATA : FRAME_STEP_ID;
+  }
+
+  // a hello of a node ADDRESS_MAX_DEPTH deep carries its offer and marker
+  // past the end of the address, a connect request keeps them in overflow
+  void pushElement(uint16_t element)
+  {
+    if (pocket->address.push_back(element))
+      return;
+    if (!isData && overflowCount < 2)
+      overflow[overflowCount++] = element;
+    else
+      tooDeep = true;
+  }
+
+  // little endian uint16, true when complete
+  bool pushWordByte(uint8_t b)
+  {
+    word |= uint32_t(b) << shift;
+    shift += 8;
+    return shift == 16;
+  }
+
+  void pushByte(uint8_t b)
+  {
+    if (step != FRAME_STEP_CHECKSUM)
+      crc.update(b);
+
+    switch (step)
+    {
+    case FRAME_STEP_ADDRESS:
+      if (!pushWordByte(b))
+        return;
+      if (word == 0)
+        step = isData ? dataStep() : FRAME_STEP_DONE;
+      else
+        pushElement(word);
+      word = shift = 0;
+      return;
+
+    case FRAME_STEP_HEADER:
+      knownVersion = (b >> 5) == version;
+      length = b & FRAME_V2_MAX_LENGTH;
+      if (!knownVersion)
+        step = FRAME_STEP_DONE;
+      else
+        step = length > 0 ? FRAME_STEP_VARINT_ADDRESS : dataStep();
+      return;
+
+    case FRAME_STEP_VARINT_ADDRESS:
+      word |= uint32_t(b & 0x7F) << shift;
+      shift += 7;
+      if ((b & 0x80) && shift < 21)
+        return;
+      pushElement(word);
+      word = shift = 0;
+      if (++count == length)
+      {
+        count = 0;
+        step = dataStep();
+      }
+      return;
+
+    case FRAME_STEP_BUNDLED_HEADER:
+      length = b & FRAME_V2_MAX_LENGTH;
+      if (b & FRAME_SAME_ADDRESS)
+      {
+        // not sent, but covered by the CRC
+        for (uint16_t part : lastAddress)
+        {
+          uint8_t bytes[3];
+          uint8_t n = varintEncode(part, bytes);
+          for (uint8_t i = 0; i < n; i++)
+            crc.update(bytes[i]);
+          pushElement(part);
+        }
+        length = 0;
+      }
+      step = length > 0 ? FRAME_STEP_VARINT_ADDRESS : dataStep();
+      return;
+
+    case FRAME_STEP_LENGTH:
+      if (version >= FRAME_VERSION_5 && !bundle)
+      {
+        if ((b & FRAME_BUNDLE) == FRAME_BUNDLE && pocket->address.empty())
+        {
+          bundle = true;
+          beginPocket();
+          bundleLeft = b & ~FRAME_BUNDLE;
+          tooLong = bundleLeft == 0 || bundleLeft > FRAME_BUNDLE_MAX;
+          bundleLeft--;
+          step = tooLong ? FRAME_STEP_DONE : FRAME_STEP_BUNDLED_HEADER;
+          return;
+        }
+        ack = b & FRAME_ACK;
+        b &= ~FRAME_ACK;
+      }
+      pocket->length = b & ~FRAME_FRAGMENTED;
+      tooLong = pocket->length > DATASIZE;
+      if (version >= FRAME_VERSION_4)
+        crc.kind = frameCrcKind(pocket->length);
+      routable = !tooLong && !bundle;
+      if (tooLong)
+        step = FRAME_STEP_DONE;
+      else if (b & FRAME_FRAGMENTED)
+        step = FRAME_STEP_FRAGMENT;
+      else
+        step = payloadStep();
+      return;
+
+    case FRAME_STEP_FRAGMENT:
+      pocket->fragment = b;
+      step = FRAME_STEP_FRAGMENTS;
+      return;
+
+    case FRAME_STEP_FRAGMENTS:
+      pocket->fragments = b;
+      step = payloadStep();
+      return;
+
+    case FRAME_STEP_DATA:
+      pocket->data[count++] = b;
+      if (count == pocket->length)
+        step = payloadStep();
+      return;
+
+    case FRAME_STEP_ID:
+      if (!pushWordByte(b))
+        return;
+      pocket->id = word;
+      word = shift = 0;
+      step = FRAME_STEP_CHECKSUM;
+      return;
+
+    case FRAME_STEP_CHECKSUM:
+      word |= uint32_t(b) << shift;
+      shift += 8;
+      if (shift < crc.bytes() * 8)
+        return;
+      checksum = word;
+      if (bundle)
+        lastAddress = pocket->address;
+      step = bundle && bundleLeft-- > 0 ? FRAME_STEP_NEXT : FRAME_STEP_DONE;
+      return;
+
+    default:
+      return;
+    }
+  }
+};
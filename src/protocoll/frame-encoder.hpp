@@ -0,0 +1,184 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "./frame.hpp"
+#include "./fec.hpp"
+
+// longer than any data frame: every address element as a 3 byte varint,
+// the terminator, length and fragment bytes, a full payload and a CRC-32
+#define FRAME_MAX_BITS (2 + (ADDRESS_MAX_DEPTH + 1) * 24 + (DATASIZE + 9) * 8)
+
+// A frame as the bits that go on the wire, first bit first. Bytes are added
+// to crc as they are pushed.
+struct FrameBits
+{
+  uint8_t bytes[(FEC_WIRE_BITS(FRAME_MAX_BITS) + 7) / 8];
+  uint16_t count = 0;
+  FrameCrc crc;
+
+  bool operator[](size_t i) const { return bytes[i / 8] & (0x80 >> (i % 8)); }
+
+  void clear()
+  {
+    count = 0;
+    crc.begin(0);
+  }
+
+  void push(bool bit)
+  {
+    uint8_t mask = 0x80 >> (count % 8);
+    if (bit)
+      bytes[count / 8] |= mask;
+    else
+      bytes[count / 8] &= ~mask;
+    count++;
+  }
+
+  // MSB first
+  void pushByte(uint8_t value)
+  {
+    crc.update(value);
+    for (int i = 7; i >= 0; i--)
+      push((value >> i) & 1);
+  }
+
+  void pushUInt16(uint16_t value)
+  {
+    pushByte(value & 0xFF);
+    pushByte(value >> 8);
+  }
+
+  void pushVarint(uint16_t value)
+  {
+    while (value >= 0x80)
+    {
+      pushByte((value & 0x7F) | 0x80);
+      value >>= 7;
+    }
+    pushByte(value);
+  }
+};
+
+// length byte, fragment, data, id and checksum of a v3 or newer frame
+inline void pushPayload(const Pocket &p, uint8_t version, FrameBits &out, uint8_t flags)
+{
+  out.pushByte((p.fragmented() ? FRAME_FRAGMENTED : 0) | flags | p.length);
+  if (p.fragmented())
+  {
+    out.pushByte(p.fragment);
+    out.pushByte(p.fragments);
+  }
+  for (int i = 0; i < p.length; i++)
+    out.pushByte(p.data[i]);
+
+  out.pushUInt16(p.id);
+  if (version < FRAME_VERSION_4)
+  {
+    out.pushUInt16(p.calculateChecksum());
+    return;
+  }
+
+  uint32_t crc = out.crc.value();
+  for (uint8_t i = 0; i < out.crc.bytes(); i++)
+    out.pushByte(crc >> (i * 8));
+}
+
+// Data frame of p in version, start bit included. p has to be
+// frameEncodable, the checksum is the one of the frame as sent. flags go
+// into the length byte of v3 and newer (FRAME_ACK).
+inline void encodeFrame(const Pocket &p, uint8_t version, FrameBits &out, uint8_t flags = 0)
+{
+  out.clear();
+  out.push(1); // start
+  out.push(1); // data frame
+
+  if (version >= FRAME_VERSION_4)
+    out.crc.begin(frameCrcKind(p.length));
+
+  if (version >= FRAME_VERSION_2)
+  {
+    out.pushByte((version << 5) | p.address.size());
+    for (uint16_t part : p.address)
+      out.pushVarint(part);
+  }
+  else
+  {
+    for (uint16_t part : p.address)
+      out.pushUInt16(part);
+    out.pushUInt16(0); // end of address
+  }
+
+  if (version >= FRAME_VERSION_3)
+  {
+    pushPayload(p, version, out, flags);
+    return;
+  }
+
+  // padded with spaces as it goes out, p itself is not copied
+  for (int i = 0; i < FRAME_FIXED_DATASIZE; i++)
+    out.pushByte(i < p.length ? p.data[i] : ' ');
+
+  out.pushUInt16(p.id);
+  out.pushUInt16(p.calculateChecksum(FRAME_FIXED_DATASIZE));
+}
+
+// v5 bundle of count pockets for one next hop (see frame.hpp), each one
+// frameEncodable
+inline void encodeBundle(const Pocket *const *pockets, uint8_t count, FrameBits &out)
+{
+  out.clear();
+  out.push(1); // start
+  out.push(1); // data frame
+  out.pushByte(FRAME_VERSION_5 << 5);
+  out.pushByte(FRAME_BUNDLE | count);
+
+  for (uint8_t n = 0; n < count; n++)
+  {
+    const Pocket &p = *pockets[n];
+    const Address &before = n > 0 ? pockets[n - 1]->address : p.address;
+    bool sameAddress = n > 0 && before.size() == p.address.size() &&
+                       commonPrefix(before, p.address, p.address.size()) == p.address.size();
+    out.crc.begin(frameCrcKind(p.length));
+
+    if (sameAddress)
+    {
+      out.pushByte(FRAME_SAME_ADDRESS);
+      for (uint16_t part : p.address)
+      {
+        uint8_t bytes[3];
+        uint8_t length = varintEncode(part, bytes);
+        for (uint8_t i = 0; i < length; i++)
+          out.crc.update(bytes[i]); // covered, not sent
+      }
+    }
+    else
+    {
+      out.pushByte(p.address.size());
+      for (uint16_t part : p.address)
+        out.pushVarint(part);
+    }
+    pushPayload(p, FRAME_VERSION_5, out, 0);
+  }
+}
+
+// the encoded frame in out with forward error correction, see fec.hpp
+inline void protectFrame(FrameBits &out)
+{
+  uint16_t bytes = (out.count - FEC_PLAIN_BITS) / 8;
+
+  // last byte first, the code words of a byte only cover bytes already done
+  for (int n = bytes - 1; n >= 0; n--)
+  {
+    uint8_t value = 0;
+    for (uint8_t i = 0; i < 8; i++)
+      value = value << 1 | out[FEC_PLAIN_BITS + n * 8 + i];
+
+    uint16_t code = fecEncodeByte(value);
+    out.count = FEC_PLAIN_BITS + n * FEC_BYTE_BITS;
+    for (int i = FEC_BYTE_BITS - 1; i >= 0; i--)
+      out.push(code >> i & 1);
+  }
+  out.count = FEC_PLAIN_BITS + bytes * FEC_BYTE_BITS;
+}
@@ -0,0 +1,188 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "./address.hpp"
+#include "./pocket.hpp"
+#include "./raw-communication.hpp"
+#include "./crc.hpp"
+
+// Data frame versions, chosen per connection. After the start and type bit:
+//
+// v1: every address element as uint16, then a 0 terminator (so 0 can't be
+//     an address element)
+// v2: one header byte (version << 5 | address length), then every element
+//     as a varint (7 bits per byte, low bits first, high bit = more follows)
+// v3: like v2, then a length byte (FRAME_FRAGMENTED | payload length), the
+//     fragment index and count if FRAME_FRAGMENTED is set and only as many
+//     data bytes as the payload has
+// v4: like v3, but the checksum is a CRC over every byte from the header to
+//     the id: CRC-16/CCITT for payloads up to FRAME_CRC16_MAX_PAYLOAD bytes,
+//     CRC-32 for longer ones (see crc.hpp)
+// v5: like v4, the receiver acknowledges every data frame. FRAME_ACK in the
+//     length byte marks an acknowledgement frame: no address, the payload is
+//     the uint16 ids of the pockets it acknowledges, the id is 0 (see
+//     ack-window.hpp). FRAME_BUNDLE in the length byte of a frame without
+//     address marks a bundle of up to FRAME_BUNDLE_MAX pockets for the same
+//     next hop, the low bits are their number. Each follows as a v5 frame
+//     without start and type bit whose header byte holds only the address
+//     length, or FRAME_SAME_ADDRESS for the address of the one before, and
+//     has its own id and CRC. The CRC covers that address as if it was sent.
+//
+// v1 and v2 always carry FRAME_FIXED_DATASIZE data bytes, shorter payloads
+// padded with spaces. All continue with the id and checksum, up to v3 the
+// Fletcher sum of Pocket::calculateChecksum over address and data. A connection
+// starts at v1 and moves to the highest version both sides speak once the
+// peer accepted a hello (see send-hello.hpp). Data frames of a v2 or newer
+// connection use its negotiated bit time, management frames always
+// BIT_DELAY. Both begin with a HIGH start bit: a management frame follows it
+// with LOW, a newer data frame with one more HIGH bit and the header, whose
+// first two bits are 01 or 10, so its first pulse is at most three bit times
+// long and the length of the first pulse tells them apart.
+#define FRAME_VERSION_1 1
+#define FRAME_VERSION_2 2
+#define FRAME_VERSION_3 3
+#define FRAME_VERSION_4 4
+#define FRAME_VERSION_5 5
+#define FRAME_VERSION_MAX FRAME_VERSION_5
+
+#define FRAME_V2_MAX_LENGTH 0x1F // address length field of the v2 header
+#define FRAME_FIXED_DATASIZE 16  // data bytes of v1 and v2 frames
+#define FRAME_FRAGMENTED 0x80    // in the v3 length byte
+#define FRAME_ACK 0x40           // in the v5 length byte
+#define FRAME_BUNDLE (FRAME_FRAGMENTED | FRAME_ACK) // both in the v5 length byte
+#define FRAME_BUNDLE_MAX 8       // pockets per bundle
+#define FRAME_SAME_ADDRESS 0x80  // header byte of a pocket in a bundle
+#define FRAME_CRC16_MAX_PAYLOAD 16
+
+// A node listens again within this after the last bit it sent, so nothing
+// is sent back before that on the pin a data frame came in on.
+#define FRAME_TURNAROUND_US 2000
+
+// CRC_16 or CRC_32 for a v4 frame with this payload length
+inline uint8_t frameCrcKind(uint8_t payloadLength)
+{
+  return payloadLength > FRAME_CRC16_MAX_PAYLOAD ? CRC_32 : CRC_16;
+}
+
+// Line codes of fast data frames, agreed per connection by the hello. NRZ
+// holds the level of a bit for its whole bit time, the receiver samples the
+// middle of every bit relative to the start of the frame. Manchester splits
+// every bit into two halves (1 = LOW, HIGH and 0 = HIGH, LOW), the
+// transition in the middle of each bit lets the receiver follow the clock of
+// the sender, so drift between both clocks doesn't add up over a frame.
+// Management frames and data frames at BIT_DELAY always use NRZ.
+#define LINE_CODE_NRZ 0
+#define LINE_CODE_MANCHESTER 1
+
+#ifndef LINE_CODE_DEFAULT
+#define LINE_CODE_DEFAULT LINE_CODE_MANCHESTER
+#endif
+
+inline const char *lineCodeName(uint8_t lineCode)
+{
+  return lineCode == LINE_CODE_MANCHESTER ? "Manchester" : "NRZ";
+}
+
+// A hello is a connect request with our address, an offer (FRAME_HELLO_OFFER
+// | line code << 8 | fastest rate, never 0 like the address terminator) and
+// this marker, whose low byte carries our highest frame version and
+// FRAME_HELLO_FEC if we offer error correction (an older peer takes it for
+// a version above its own). Address elements from FRAME_HELLO_MARKER on are
+// reserved, so a connect request that ends in one is always a hello.
+#define FRAME_HELLO_OFFER 0x8000
+#define FRAME_HELLO_MARKER 0xFF00
+#define FRAME_HELLO_FEC 0x80
+#define FRAME_HELLO_ATTEMPTS 3
+#define FRAME_HELLO_BACKOFF_BITS 200 // random wait before a hello, in bit times
+
+inline size_t varintBytes(uint16_t value)
+{
+  return value < 0x80 ? 1 : value < 0x4000 ? 2 : 3;
+}
+
+// the varint of value into out, returns its length
+inline uint8_t varintEncode(uint16_t value, uint8_t *out)
+{
+  uint8_t n = 0;
+  while (value >= 0x80)
+  {
+    out[n++] = (value & 0x7F) | 0x80;
+    value >>= 7;
+  }
+  out[n++] = value;
+  return n;
+}
+
+// false if address can't be sent in this frame version
+inline bool frameAddressEncodable(const Address &address, uint8_t version)
+{
+  if (version >= FRAME_VERSION_2 && address.size() > FRAME_V2_MAX_LENGTH)
+    return false;
+
+  for (uint16_t part : address)
+  {
+    if ((part == 0 && version < FRAME_VERSION_2) || part >= FRAME_HELLO_MARKER)
+      return false;
+  }
+  return true;
+}
+
+// false if p can't be sent in this frame version
+inline bool frameEncodable(const Pocket &p, uint8_t version)
+{
+  if (version < FRAME_VERSION_3 && (p.length > FRAME_FIXED_DATASIZE || p.fragmented()))
+    return false;
+  return frameAddressEncodable(p.address, version);
+}
+
+// false if p can't be sent in this frame version even with its data cut to
+// FRAME_FIXED_DATASIZE bytes, as v1 and v2 frames always did
+inline bool frameSendable(const Pocket &p, uint8_t version)
+{
+  if (version < FRAME_VERSION_3 && p.fragmented())
+    return false;
+  return frameAddressEncodable(p.address, version);
+}
+
+// bit times of a data frame, start and type bit included
+inline size_t frameBits(const Pocket &p, uint8_t version)
+{
+  size_t bits = 2 + 4 * 8; // id, checksum
+
+  if (version >= FRAME_VERSION_2)
+  {
+    bits += 8;
+    for (uint16_t part : p.address)
+      bits += varintBytes(part) * 8;
+  }
+  else
+  {
+    bits += (p.address.size() + 1) * 16;
+  }
+
+  if (version >= FRAME_VERSION_3)
+    bits += (1 + (p.fragmented() ? 2 : 0) + p.length) * 8;
+  else
+    bits += FRAME_FIXED_DATASIZE * 8;
+
+  if (version >= FRAME_VERSION_4 && frameCrcKind(p.length) == CRC_32)
+    bits += 2 * 8;
+  return bits;
+}
+
+// bit times p adds to a bundle, sameAddress if it follows a pocket to the
+// same address
+inline size_t bundledBits(const Pocket &p, bool sameAddress)
+{
+  size_t bits = frameBits(p, FRAME_VERSION_5) - 2;
+  if (sameAddress)
+  {
+    for (uint16_t part : p.address)
+      bits -= varintBytes(part) * 8;
+  }
+  return bits;
+}
+
+#define FRAME_BUNDLE_BITS (2 + 2 * 8) // of a bundle before its pockets
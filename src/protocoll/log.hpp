@@ -0,0 +1,39 @@
+#pragma once
+
+#include "../hal/index.hpp"
+
+// Compile time log levels, everything above LOG_LEVEL is removed by the
+// preprocessor. Per pocket messages are DEBUG, so they cost nothing unless
+// built with -D LOG_LEVEL=LOG_LEVEL_DEBUG. Use the trace ring for per pocket
+// events instead.
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_DEBUG 3
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+#define LOG_NOTHING() \
+  do                  \
+  {                   \
+  } while (0)
+
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_ERROR(fmt, ...) HAL_LOGF(fmt "\n", ##__VA_ARGS__)
+#else
+#define LOG_ERROR(fmt, ...) LOG_NOTHING()
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(fmt, ...) HAL_LOGF(fmt "\n", ##__VA_ARGS__)
+#else
+#define LOG_INFO(fmt, ...) LOG_NOTHING()
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(fmt, ...) HAL_LOGF(fmt "\n", ##__VA_ARGS__)
+#else
+#define LOG_DEBUG(fmt, ...) LOG_NOTHING()
+#endif
@@ -1,15 +1,17 @@
 #pragma once
 
-#include <Arduino.h>
+#include "../hal/index.hpp"
 #include <vector>
 #include <algorithm>
 #include <string.h>
 
-using namespace std;
+#include "./address.hpp"
+#include "./log.hpp"
+#include "./trace.hpp"
+#include "./frame.hpp"
+#include "./fec.hpp"
 
-struct Address : public vector<uint16_t>
-{
-};
+using namespace std;
 
 struct Match
 {
@@ -22,16 +24,10 @@ Match match(const Address &connection, const Address &pocket)
   size_t minLen = min(connection.size(), pocket.size());
   Match m = {0, 0};
 
-  while (m.positive < minLen && connection[m.positive] == pocket[m.positive])
-  {
-    m.positive++;
-  }
+  m.positive = commonPrefix(connection, pocket, minLen);
   m.negative = connection.size() - m.positive;
 
-  Serial.print("[Protocol] match: positive=");
-  Serial.print(m.positive);
-  Serial.print(", negative=");
-  Serial.println(m.negative);
+  LOG_DEBUG("[Protocol] match: positive=%u, negative=%u", m.positive, m.negative);
 
   return m;
 }
@@ -39,8 +35,7 @@ Match match(const Address &connection, const Address &pocket)
 int matchIndex(const Match &m)
 {
   int index = m.positive - m.negative;
-  Serial.print("[Protocol] matchIndex: index=");
-  Serial.println(index);
+  LOG_DEBUG("[Protocol] matchIndex: index=%d", index);
   return index;
 }
 
@@ -49,13 +44,7 @@ bool eq(const Address &a1, const Address &a2)
   if (a1.size() != a2.size())
     return false;
 
-  for (size_t i = 0; i < a1.size(); i++)
-  {
-    if (a1.at(i) != a2.at(i))
-      return false;
-  }
-
-  return true;
+  return commonPrefix(a1, a2, a1.size()) == a1.size();
 }
 
 bool isChildren(const Address &other, const Address &you)
@@ -63,80 +52,247 @@ bool isChildren(const Address &other, const Address &you)
   if (other.size() <= you.size())
     return false;
 
-  for (size_t i = 0; i < you.size(); i++)
-  {
-    if (other.at(i) != you.at(i))
-      return false;
-  }
-
-  return true;
+  return commonPrefix(other, you, you.size()) == you.size();
 }
 
+// A connection is known by its pin. Usually both directions share that
+// wire, a two-wire connection receives on pin and sends on its own txPin
+// (wired to the pin of the peer), so both ends can send at the same time.
 struct Connection
 {
   Address address;
   uint8_t pin;
+  uint8_t txPin;            // own transmit line, 0 if pin is used both ways
+  uint8_t version;          // frame version spoken on this connection
+  uint8_t helloLeft;        // hellos still to send, 0 once the version is settled
+  uint8_t rate;             // index into BIT_TIMES, negotiated by the hello
+  uint8_t rateCap;          // fastest rate we offer in a hello
+  uint8_t lineCode;         // LINE_CODE_*, negotiated by the hello
+  uint8_t lineCodeCap;      // line code we offer in a hello
+  bool fec;                 // data frames carry error correction, negotiated by the hello
+  bool fecCap;              // we offer error correction in a hello
+  uint8_t checksumFailures; // unreadable frames in a row, at the current rate
+
+  Connection() : pin(0), txPin(0) { reset(); }
+  Connection(const Address &a, uint8_t p, uint8_t tx = 0) : address(a), pin(p), txPin(tx) { reset(); }
+
+  // back to v1 at BIT_DELAY, to be negotiated again
+  void reset()
+  {
+    version = FRAME_VERSION_1;
+    helloLeft = FRAME_HELLO_ATTEMPTS;
+    rate = 0;
+    rateCap = BIT_RATE_FASTEST;
+    lineCode = LINE_CODE_NRZ;
+    lineCodeCap = LINE_CODE_DEFAULT;
+    fec = false;
+    fecCap = FEC_DEFAULT;
+    checksumFailures = 0;
+  }
+
+  // bit time of data frames on this connection
+  uint32_t bitTime() const { return version >= FRAME_VERSION_2 ? BIT_TIMES[rate] : BIT_DELAY; }
+
+  // line code of data frames on this connection
+  uint8_t dataLineCode() const { return bitTime() < BIT_DELAY ? lineCode : LINE_CODE_NRZ; }
+
+  // the peer acknowledges our data frames
+  bool acknowledged() const { return version >= FRAME_VERSION_5; }
+
+  bool duplex() const { return txPin != 0 && txPin != pin; }
+
+  // the pin we drive to send to the peer
+  uint8_t sendPin() const { return duplex() ? txPin : pin; }
 };
 
 #include "./pocket.hpp"
+#include "./routing-table.hpp"
+#include "./route-cache.hpp"
 
 struct Node
 {
   vector<Connection> connections;
   Address you;
+  RoutingTable routes;
+  vector<bool> childConnections; // isChildren(connection, you), per connection
+  RouteCache cache;
+  uint32_t epoch = 1;
+  TraceRing *trace = nullptr;
+
+  // Taken by routeBatch and by every swap of connections, you and the
+  // routes built from them, so another task routes with either the old or
+  // the new ones. Only the task that owns the connections (PhysLoop once
+  // started) changes them, see PhysikalNode::setConnections.
+  hal::Mutex routesLock;
+
+  bool multipath = true;                         // spread pockets over equally good connections
+  bool balanceByBacklog = false;                 // prefer the path with the shortest send queue
+  const volatile uint16_t *pinBacklog = nullptr; // queued pockets per pin, set by the PhysikalNode
 
-  uint8_t send(Pocket p)
+  Connection *connectionOn(uint8_t pin)
   {
-    if (connections.empty())
+    for (auto &connection : connections)
     {
-      Serial.println("[Protocol] send: no connections available");
-      return 0;
+      if (connection.pin == pin)
+        return &connection;
     }
-    
-    if (eq(you, p.address))
+    return nullptr;
+  }
+
+  // call after every change to connections or you by their owner
+  void updateRoutes()
+  {
+    vector<Connection> same = connections;
+    setConnections(same, you);
+  }
+
+  // Replaces connections and you, next gets the old connections. The routes
+  // are built aside and swapped in with them.
+  void setConnections(vector<Connection> &next, const Address &nextYou)
+  {
+    RoutingTable table;
+    table.build(next);
+
+    vector<bool> children(next.size());
+    for (size_t i = 0; i < next.size(); i++)
+      children[i] = isChildren(next[i].address, nextYou);
+
+    routesLock.lock();
+    connections.swap(next);
+    you = nextYou;
+    routes.swap(table);
+    childConnections.swap(children);
+
+    // invalidates every cached route, 0 is reserved for empty cache entries
+    if (++epoch == 0)
+      epoch = 1;
+    routesLock.unlock();
+  }
+
+  // copy of connections and you, for a task that doesn't own them
+  void copyConnections(vector<Connection> &out, Address &outYou)
+  {
+    routesLock.lock();
+    out = connections;
+    outYou = you;
+    routesLock.unlock();
+  }
+
+  uint8_t send(const Pocket &p)
+  {
+    uint8_t pin;
+    routeBatch(&p, 1, &pin);
+    return pin;
+  }
+
+  // Next hop of every pocket into pins (0 = the pocket stays here). The
+  // connection checks and the epoch are read once per batch and consecutive
+  // pockets to the same destination share one routing decision.
+  void routeBatch(const Pocket *pockets, size_t count, uint8_t *pins)
+  {
+    routesLock.lock();
+    if (connections.empty())
     {
-      Serial.println("[Protocol] recieve: packet is for us");
-      return 0;
+      routesLock.unlock();
+      LOG_DEBUG("[Protocol] send: no connections available");
+      memset(pins, 0, count);
+      return;
     }
 
-    Serial.println("[Protocol] send: selecting best connection...");
+    uint32_t currentEpoch = epoch;
+    const Address *previous = nullptr;
+    uint32_t hash = 0;
+    Route current;
 
-    Connection sendConnection = connections.at(0);
-    int bestMatchIndex = matchIndex(match(sendConnection.address, p.address));
-    int bestAdressLength = sendConnection.address.size();
+    for (size_t i = 0; i < count; i++)
+    {
+      const Address &destination = pockets[i].address;
 
-    bool isDirectChildren = isChildren(p.address, you);
+      if (previous == nullptr || !eq(*previous, destination))
+      {
+        hash = RouteCache::hash(destination);
+        if (!cache.lookup(destination, hash, currentEpoch, current))
+        {
+          current = route(destination);
+          cache.store(destination, hash, currentEpoch, current);
+        }
+        previous = &destination;
+      }
 
-    for (size_t i = 1; i < connections.size(); i++)
-    {
-      int currentMatchIndex = matchIndex(match(connections[i].address, p.address));
+      pins[i] = choosePin(current, hash, pockets[i].id);
 
-      if (currentMatchIndex > bestMatchIndex)
+      if (pins[i] != 0)
       {
-        sendConnection = connections[i];
-        bestMatchIndex = currentMatchIndex;
+        LOG_DEBUG("[Protocol] send: sending via pin %u", pins[i]);
+        if (trace)
+          trace->record(TRACE_ROUTE, pins[i], pockets[i].id, current.score);
       }
-      else if (currentMatchIndex == bestMatchIndex && bestAdressLength < connections[i].address.size())
+    }
+    routesLock.unlock();
+  }
+
+  // One of the equally good paths, picked by a flow hash of destination and
+  // pocket id. With balanceByBacklog the path with the fewest queued pockets
+  // wins and the hash only breaks ties.
+  uint8_t choosePin(const Route &route, uint32_t destinationHash, uint16_t id) const
+  {
+    if (route.count == 0)
+      return 0;
+    if (!multipath || route.count == 1)
+      return connections[route.paths[0]].pin;
+
+    uint32_t flow = (destinationHash ^ id) * 2654435761u;
+    size_t first = (flow >> 16) % route.count;
+    uint8_t pin = connections[route.paths[first]].pin;
+
+    if (balanceByBacklog && pinBacklog != nullptr)
+    {
+      for (size_t k = 1; k < route.count; k++)
       {
-        bestAdressLength = connections[i].address.size();
-        sendConnection = connections[i];
-        bestMatchIndex = currentMatchIndex;
+        uint8_t other = connections[route.paths[(first + k) % route.count]].pin;
+        if (pinBacklog[other] < pinBacklog[pin])
+          pin = other;
       }
     }
 
-    // if the pocket is for a direct child, but the node is the last (its a virtual children)
-    if (isDirectChildren && !isChildren(sendConnection.address, you))
+    return pin;
+  }
+
+  // uncached routing decision, under routesLock
+  Route route(const Address &destination)
+  {
+    Route result;
+
+    if (eq(you, destination))
     {
-      return 0;
+      LOG_DEBUG("[Protocol] recieve: packet is for us");
+      return result;
     }
 
-    Serial.print("[Protocol] send: sending via pin ");
-    Serial.println(sendConnection.pin);
+    LOG_DEBUG("[Protocol] send: selecting best connection...");
+
+    int score = 0;
+    size_t count = routes.lookup(destination, result.paths, &score);
+    if (count == 0)
+    {
+      LOG_ERROR("[Protocol] send: routing table not built");
+      return result;
+    }
+
+    bool isDirectChildren = isChildren(destination, you);
+
+    // if the pocket is for a direct child, but the node is the last (its a virtual children)
+    if (isDirectChildren && !childConnections[result.paths[0]])
+    {
+      return result;
+    }
 
-    return sendConnection.pin;
+    result.count = count;
+    result.score = score;
+    return result;
   }
 
-  uint8_t recieve(Pocket p)
+  uint8_t recieve(const Pocket &p)
   {
     return send(p);
   }
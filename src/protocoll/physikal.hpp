@@ -1,177 +1,995 @@
 #pragma once
 
-#include <Arduino.h>
 #include <vector>
-#include <queue>
 #include <functional>
-#include <freertos/FreeRTOS.h>
-#include <freertos/task.h>
-#include <freertos/queue.h>
+
+#include "../hal/index.hpp"
 
 #include "./raw-communication.hpp"
+#include "./reassembly.hpp"
+#include "./duplicate-filter.hpp"
 #include "logical.hpp"
 
-#define NORMAL_SEND 1
-#define RETURN_OK 2
+#define SEND_BATCH_SIZE 16 // pockets routed per pass of sendBatch
+
+#define FRAGMENT_QUEUE_TIMEOUT_MS 30000 // send() waits this long for room per fragment
+#define MAX_PORTS 16     // connection pins served at once
 
-#define RESEND_TIMEOUT 5000 // milliseconds
-#define MAX_ATTEMPTS 50
+#ifndef CUT_THROUGH
+#define CUT_THROUGH false // default of PhysikalNode::cutThrough
+#endif
+#ifndef FRAME_BUNDLES
+#define FRAME_BUNDLES true // default of PhysikalNode::bundleFrames
+#endif
 
 using std::vector;
 
+enum PoolUse : uint8_t
+{
+  POOL_SEND,
+  POOL_RECEIVE
+};
+
 struct SendRequest
 {
   Pocket pocket;
   uint8_t pin;
-  SendRequest(const Pocket &p, uint8_t pin_) : pocket(p), pin(pin_) {}
+  uint8_t attempts; // transmissions on pin so far
+  SendRequest() : pin(0), attempts(0) {}
+  SendRequest(const Address &a, const char *d) : pocket(a, d), pin(0), attempts(0) {}
+  SendRequest(const Pocket &p, uint8_t pin_) : pocket(p), pin(pin_), attempts(0) {}
+
+  // from the pocket pool, new returns nullptr once it is exhausted
+  static void *operator new(size_t size) noexcept;
+  static void *operator new(size_t size, PoolUse use) noexcept;
+  static void operator delete(void *block) noexcept;
+  static void operator delete(void *block, PoolUse use) noexcept;
+};
+
+#include "./pocket-pool.hpp"
+
+#include "./edge-receiver.hpp"
+#include "./pin-transmitter.hpp"
+#include "./ack-window.hpp"
+#include "./pin-queue.hpp"
+#include "./collision-backoff.hpp"
+
+#define HELLO_ANSWER_EDGES 16 // kept of the answer to a hello, it has at most 11
+
+// Management exchange of a port, hellos and answers go out at BIT_DELAY
+// through the TX tick like any frame, see PhysikalNode::stepManagement.
+enum ManagementStep
+{
+  MANAGEMENT_NONE,
+  MANAGEMENT_HELLO,        // our hello is on the wire
+  MANAGEMENT_HELLO_ANSWER, // the answer to it arrives
+  MANAGEMENT_ANSWER_DUE,   // our answer starts at managementAt
+  MANAGEMENT_ANSWER        // our answer is on the wire
+};
+
+// Everything the PhysLoop task keeps per connection pin. tx drives the pin
+// too, or the own transmit line of a two-wire connection.
+struct PinPort
+{
+  PinReceiver rx;
+  PinTransmitter tx;
+  PinQueue queue; // waiting for tx, filled by every task under portsLock
+  AckWindow acks; // sent and waiting for the peer
+  CollisionBackoff backoff;
+
+  uint8_t management = MANAGEMENT_NONE; // the exchange owns the port until it is over
+  uint32_t managementAt = 0;            // our answer starts, or our hello ended
+  uint32_t answerEdges[HELLO_ANSWER_EDGES]; // captured since our hello ended
+  uint8_t answerEdgeCount = 0;
+
+  PinPort(uint8_t pin, uint8_t txPin) : rx(pin), tx(txPin) {}
+
+  // a frame relayed from or to another port is cut off, neither side keeps
+  // a pointer to this one
+  ~PinPort()
+  {
+    if (tx.source != nullptr)
+      tx.source->relay = nullptr;
+    if (rx.relay != nullptr)
+    {
+      rx.relay->abort();
+      rx.relay->source = nullptr;
+      rx.relay = nullptr;
+    }
+    while (!queue.empty())
+      delete queue.pop();
+  }
+
+  uint8_t pin() const { return rx.pin(); }
+
+  bool duplex() const { return tx.pin != rx.pin(); }
+
+  // A frame of ours may start: on a shared wire only while nothing arrives,
+  // after the turnaround and the backoff of a collision, an own transmit
+  // line only rests a turnaround after our last frame, so the peer tells the
+  // frames apart.
+  bool lineFree(uint32_t now) const
+  {
+    if (!tx.idle() || management != MANAGEMENT_NONE)
+      return false;
+    if (duplex())
+      return tx.rested(now);
+    return backoff.over(now) && rx.idle() && rx.settled(now) && !carrier();
+  }
+
+  // the peer drives the shared wire, or began a frame since we looked
+  bool carrier() const { return !duplex() && (!rx.idle() || hal::digitalRead(pin()) == HIGH); }
+
+  // our next data frame may start, see AckWindow::slotOpen. The peer of a
+  // two-wire connection acknowledges on its own line.
+  bool slotOpen(uint32_t now) const { return duplex() || acks.slotOpen(now); }
 };
 
 struct PhysikalNode
 {
   Node logicalNode;
-  TaskHandle_t taskHandle = nullptr;
-  QueueHandle_t sendQueue = nullptr;
+  TraceRing trace;
+  hal::Task task;
+  hal::Timer txTimer;
+  volatile bool running = false;
+
+  // pockets queued per pin, changed by every task under portsLock
+  volatile uint16_t pinBacklog[256] = {};
+
+  // one per connection pin, changed by the PhysLoop task under portsLock
+  PinPort *ports[MAX_PORTS] = {};
+  size_t portCount = 0;
+  size_t firstPort = 0; // served first in the next pass, turns every pass
+  hal::Spinlock portsLock;
+
+  uint32_t nextHelloMs = 0;
+
+  // handed over by setConnections, under logicalNode.routesLock
+  vector<Connection> pendingConnections;
+  Address pendingYou;
+  volatile bool connectionsPending = false;
 
-  std::function<void(Pocket pocket)> onData = nullptr;
-  std::function<void(String error, Pocket pocket)> onError = nullptr;
+  uint8_t ackWindow = ACK_WINDOW; // per acknowledged connection
+  volatile uint32_t retransmits = 0;
+  volatile uint32_t unacknowledged = 0; // given up after MAX_ATTEMPTS
+
+  bool cutThrough = CUT_THROUGH; // relay frames while they arrive, see startRelay
+  volatile uint32_t relayed = 0;
+  volatile uint32_t relaysCut = 0; // stopped within the frame
+
+  bool bundleFrames = FRAME_BUNDLES; // queued pockets share a frame, see gatherBundle
+  volatile uint32_t bundlesSent = 0;
+  volatile uint32_t pocketsBundled = 0;
+
+  bool collisionDetect = COLLISION_DETECT; // on shared wires, read when a port is set up
+
+  // PhysLoop task only, other tasks just read their counters
+  Reassembly reassembly; // of fragmented messages for us
+  DuplicateFilter duplicates;
+
+  // a pocket for us, or a whole message that came in fragments
+  std::function<void(const Pocket &pocket)> onData = nullptr;
+  std::function<void(const char *data, size_t length)> onMessage = nullptr;
+  std::function<void(const char *error, const Pocket &pocket)> onError = nullptr;
+
+  PhysikalNode()
+  {
+    logicalNode.trace = &trace;
+    logicalNode.pinBacklog = pinBacklog;
+  }
 
   static void loopTask(void *params)
   {
     static_cast<PhysikalNode *>(params)->loop();
   }
 
-  void receivePocket(uint8_t pin);
-  void handleMenagementFrame(uint8_t pin);
-  void sendNormalPocket(Pocket &p, uint8_t pin);
+  static void txTick(void *params)
+  {
+    PhysikalNode *self = static_cast<PhysikalNode *>(params);
+    uint32_t now = hal::micros();
+
+    self->portsLock.lock();
+    for (size_t i = 0; i < self->portCount; i++)
+      self->ports[i]->tx.advance(now);
+    self->portsLock.unlock();
+  }
+
+  void receivePocket(PinPort &port, SendRequest *req, const FrameDecoder &frame, PinTransmitter *relay = nullptr);
+  void receiveAck(PinPort &port, const Pocket &ack);
+  void handleMenagementFrame(PinPort &port, SendRequest *req);
+  void sendNormalPocket(PinPort &port, const Connection &conn, SendRequest *req);
+  void sendAck(PinPort &port, const Connection &conn);
+  void finishNormalPocket(PinPort &port, const Connection &conn);
+  bool startHello(PinPort &port, const Connection &connection);
+  bool helloAnswered(PinPort &port, Connection &connection, uint32_t now);
+  void frameFailed(Connection *conn, uint8_t pin);
 
   // ---- Queue helpers ----
+  // a pocket counted in pinBacklog left the node (sent, acknowledged or
+  // dropped). enqueueSend counts from another task, so never without the lock.
+  void backlogDone(uint8_t pin)
+  {
+    portsLock.lock();
+    if (pinBacklog[pin] > 0)
+      pinBacklog[pin]--;
+    portsLock.unlock();
+  }
+
+  // Queues req for req->pin, the queue owns it afterwards (deleted if
+  // full). Waits up to timeoutMs for room, only for the queue of that pin
+  // and class, or for the port of a new connection.
+  bool enqueueSend(SendRequest *req, uint32_t timeoutMs = 50)
+  {
+    uint8_t pin = req->pin;
+    uint8_t queueClass = queueClassOf(req->pocket);
+    uint32_t since = hal::millis();
+
+    while (running)
+    {
+      bool last = hal::millis() - since >= timeoutMs;
+
+      portsLock.lock();
+      PinPort *port = portOn(pin);
+      bool queued = port != nullptr && port->queue.push(req);
+      if (queued)
+        pinBacklog[pin]++;
+      else if (port != nullptr && last)
+        port->queue.dropped[queueClass]++;
+      portsLock.unlock();
+
+      if (queued)
+        return true;
+      if (last)
+        break;
+      hal::delayMs(1);
+    }
+
+    trace.record(TRACE_QUEUE_FULL, pin, req->pocket.id);
+    delete req;
+    return false;
+  }
+
+  // False if p can never go out on the connection of pin: its hello is over
+  // and the frame version can't carry p (longer data is cut for v1 and v2,
+  // see sendNormalPocket). While the hello runs the best version counts.
+  bool sendable(uint8_t pin, const Pocket &p)
+  {
+    uint8_t version = FRAME_VERSION_MAX;
+    logicalNode.routesLock.lock();
+    Connection *conn = logicalNode.connectionOn(pin);
+    if (conn != nullptr && conn->helloLeft == 0)
+      version = conn->version;
+    logicalNode.routesLock.unlock();
+
+    if (frameSendable(p, version))
+      return true;
+    if (onError)
+      onError("Pocket not encodable for this connection", p);
+    return false;
+  }
+
   bool enqueueSend(const Pocket &p, uint8_t pin)
   {
-    if (!sendQueue)
+    if (!running)
       return false;
-    SendRequest *req = new SendRequest(p, pin);
-    BaseType_t ok = xQueueSend(sendQueue, &req, pdMS_TO_TICKS(50));
-    if (ok != pdTRUE)
-    {
-      delete req;
+    SendRequest *req = newRequest(p.id);
+    if (req == nullptr)
       return false;
-    }
-    return true;
+    req->pocket = p;
+    req->pin = pin;
+    return enqueueSend(req);
+  }
+
+  // A request from the pocket pool, waits up to timeoutMs for a block. An
+  // exhausted pool is traced and refuses the pocket like a full queue.
+  SendRequest *newRequest(uint16_t id, uint32_t timeoutMs = 50)
+  {
+    uint32_t since = hal::millis();
+    SendRequest *req;
+    while ((req = new SendRequest()) == nullptr && running && hal::millis() - since < timeoutMs)
+      hal::delayMs(1);
+
+    if (req == nullptr)
+      trace.record(TRACE_POOL_EMPTY, 0, id);
+    return req;
   }
 
-  void on(Pocket p)
+  // handles a received pocket routed to sendPin and takes ownership of req,
+  // a forwarded pocket is queued in the request it was decoded into
+  void on(SendRequest *req, uint8_t sendPin)
   {
-    Serial.println("[Protocol] on: handling received pocket");
+    LOG_DEBUG("[Protocol] on: handling received pocket");
 
-    uint8_t sendPin = logicalNode.recieve(p);
+    const Pocket &p = req->pocket;
 
-    if (sendPin == 0)
+    if (sendPin == 0 && p.fragmented())
+    {
+      ReassemblySlot *message = reassembly.add(p, hal::millis());
+      if (message != nullptr)
+      {
+        LOG_DEBUG("[Protocol] on: delivering reassembled message to application layer");
+        trace.record(TRACE_DELIVER, 0, message->message);
+        if (onMessage)
+          onMessage(message->data, message->length);
+        reassembly.release(message);
+      }
+      delete req;
+    }
+    else if (sendPin == 0)
     {
-      Serial.println("[Protocol] on: delivering data to application layer");
+      LOG_DEBUG("[Protocol] on: delivering data to application layer");
+      trace.record(TRACE_DELIVER, 0, p.id);
       if (onData)
         onData(p);
+      delete req;
     }
     else if (sendPin == (uint8_t)-1)
     {
-      Serial.println("[Protocol] on: pocket cannot reach destination");
+      LOG_DEBUG("[Protocol] on: pocket cannot reach destination");
+      trace.record(TRACE_UNREACHABLE, 0, p.id);
       if (onError)
         onError("pocket cannot reach destination", p);
+      delete req;
     }
     else
     {
-      Serial.printf("[Protocol] on: forwarding pocket via pin %u\n", sendPin);
-      enqueueSend(p, sendPin);
+      LOG_DEBUG("[Protocol] on: forwarding pocket via pin %u", sendPin);
+      trace.record(TRACE_FORWARD, sendPin, p.id);
+      req->pin = sendPin;
+      enqueueSend(req, 0);
     }
   }
 
+  // PhysLoop task, no room for p in the queue of pin
+  bool queueFull(uint8_t pin, const Pocket &p)
+  {
+    portsLock.lock();
+    PinPort *port = portOn(pin);
+    bool full = port != nullptr && port->queue.full(queueClassOf(p));
+    portsLock.unlock();
+    return full;
+  }
+
   void loop()
   {
-    Serial.println("[Protocol] loop: starting main loop");
+    LOG_INFO("[Protocol] loop: starting main loop");
 
-    for (auto conn : logicalNode.connections)
-    {
-      pinMode(conn.pin, INPUT_PULLDOWN); // stabiler gegen Rauschen
-    }
+    nextHelloMs = hal::millis() + hal::random(FRAME_HELLO_BACKOFF_BITS) * (BIT_DELAY / 1000);
 
-    while (true)
+    while (running)
     {
-      // 1) process queued sends
-      if (sendQueue)
+      if (connectionsPending)
+        takeConnections();
+      syncPorts();
+
+      // every pin in turn, starting one later each pass, so a pin that keeps
+      // the task busy (a management frame) doesn't always delay the same
+      // other pins
+      firstPort = portCount > 0 ? (firstPort + 1) % portCount : 0;
+      for (size_t n = 0; n < portCount; n++)
       {
-        SendRequest *req = nullptr;
-        if (xQueueReceive(sendQueue, &req, pdMS_TO_TICKS(1)) == pdTRUE)
+        PinPort &port = *ports[(firstPort + n) % portCount];
+        Connection *conn = logicalNode.connectionOn(port.pin());
+        if (conn == nullptr)
+          continue;
+
+        // 0) a management exchange has the port to itself
+        if (port.management != MANAGEMENT_NONE)
         {
-          if (req)
+          stepManagement(port, *conn);
+          continue;
+        }
+
+        // 1) decode what arrived meanwhile
+        while (port.rx.poll(hal::micros(), *conn))
+        {
+          SendRequest *received = port.rx.req;
+          port.rx.req = nullptr;
+          PinTransmitter *relay = port.rx.takeRelay();
+
+          if (port.rx.frame.isData)
+          {
+            port.rx.quietUntil = port.rx.frameEnd() + FRAME_TURNAROUND_US;
+            receivePocket(port, received, port.rx.frame, relay);
+          }
+          else
+          {
+            // may add a connection, conn is looked up again
+            handleMenagementFrame(port, received);
+            conn = logicalNode.connectionOn(port.pin());
+            if (port.management != MANAGEMENT_NONE)
+              break; // the answer has the port to itself
+          }
+        }
+
+        for (; port.rx.tooFast > 0; port.rx.tooFast--)
+          frameFailed(conn, port.pin());
+
+        if (cutThrough && port.rx.relayDue())
+          startRelay(port, *conn);
+
+        // 2) finish and start transmissions, never into a frame we receive,
+        // acknowledgements first
+        if (port.tx.done)
+          finishNormalPocket(port, *conn);
+
+        uint32_t now = hal::micros();
+        if (port.lineFree(now))
+        {
+          if (port.acks.pendingCount > 0)
+          {
+            sendAck(port, *conn);
+          }
+          else if (port.slotOpen(now))
           {
-            sendNormalPocket(req->pocket, req->pin);
-            delete req;
+            SendRequest *next = nextToSend(port, *conn, now);
+            if (next != nullptr)
+              sendNormalPocket(port, *conn, next);
           }
         }
       }
 
-      // 2) check for incoming
+      // 3) settle the frame version of new connections
+      negotiate();
+
+      hal::delayMs(1); // yield
+    }
+  }
+
+  // Cut-through: a data frame is routed once its address and length are in
+  // and sent on while the rest of it arrives. Only if the line of the next
+  // hop is free with nothing of its own waiting, and only over a connection
+  // of the same frame version and error correction (the bits go on
+  // unchanged) that is not faster than this one, so the relay never has to
+  // wait for a bit. Every other frame is stored and forwarded.
+  void startRelay(PinPort &in, const Connection &inConn)
+  {
+    PinReceiver &rx = in.rx;
+    rx.relayChecked = true;
+    if (rx.frame.tooDeep || rx.frame.ack || rx.bitTime == 0)
+      return;
+
+    uint8_t sendPin = logicalNode.recieve(rx.req->pocket);
+    if (sendPin == 0 || sendPin == (uint8_t)-1)
+      return;
+
+    PinPort *out = portOn(sendPin);
+    Connection *outConn = logicalNode.connectionOn(sendPin);
+    if (out == nullptr || outConn == nullptr || outConn->version != inConn.version ||
+        outConn->fec != inConn.fec || outConn->bitTime() < rx.bitTime)
+      return;
+
+    uint32_t now = hal::micros();
+    if (!out->lineFree(now))
+      return;
+    if (out->acks.pendingCount > 0 || !out->slotOpen(now) ||
+        (outConn->acknowledged() && out->acks.full(ackWindow)))
+      return;
+
+    portsLock.lock();
+    bool waiting = !out->queue.empty();
+    portsLock.unlock();
+    if (waiting)
+      return;
+
+    LOG_DEBUG("[Protocol] startRelay: pin %u to pin %u", in.pin(), sendPin);
+    trace.record(TRACE_CUT_THROUGH, sendPin, 0);
+    relayed++;
+
+    if (!out->duplex())
+      out->rx.pause();
+    out->tx.relay(&rx, rx.bits, outConn->bitTime(), outConn->dataLineCode());
+    rx.relay = &out->tx;
+  }
+
+  // a pocket whose acknowledgement didn't come in time, otherwise the next
+  // queued one if the window has room
+  SendRequest *nextToSend(PinPort &port, const Connection &conn, uint32_t now)
+  {
+    SendRequest *req;
+    while ((req = port.acks.due(now)) != nullptr)
+    {
+      if (req->attempts < MAX_ATTEMPTS)
+      {
+        LOG_DEBUG("[Protocol] pocket %u not acknowledged on pin %u, sending it again", req->pocket.id, port.pin());
+        trace.record(TRACE_RETRANSMIT, port.pin(), req->pocket.id, req->attempts);
+        retransmits++;
+        return req;
+      }
+
+      LOG_ERROR("[Protocol] pocket %u not acknowledged on pin %u, giving up", req->pocket.id, port.pin());
+      trace.record(TRACE_UNACKED, port.pin(), req->pocket.id, req->attempts);
+      unacknowledged++;
+      if (onError)
+        onError("pocket not acknowledged", req->pocket);
+      backlogDone(port.pin());
+      delete req;
+    }
+
+    if (conn.acknowledged() && port.acks.full(ackWindow))
+      return nullptr;
+
+    portsLock.lock();
+    req = port.queue.pop();
+    portsLock.unlock();
+    return req;
+  }
+
+  // req and the pockets bundled with it didn't make it onto the wire, they
+  // go back to the front of the queue in their order. One that finds no
+  // room there waits in the acknowledgement window as if it was lost on the
+  // wire, elsewhere it is dropped.
+  void requeueFront(PinPort &port, const Connection &conn, SendRequest *req)
+  {
+    uint8_t pin = port.pin();
+    SendRequest *noRoom[FRAME_BUNDLE_MAX];
+    uint8_t noRoomCount = 0;
+
+    portsLock.lock();
+    for (int i = port.tx.bundledCount; i >= 0; i--)
+    {
+      SendRequest *back = i == 0 ? req : port.tx.bundled[i - 1];
+      back->attempts--;
+      if (!port.queue.pushFront(back))
+        noRoom[noRoomCount++] = back;
+    }
+    portsLock.unlock();
+    port.tx.bundledCount = 0;
+
+    uint32_t now = hal::micros();
+    for (uint8_t i = 0; i < noRoomCount; i++)
+    {
+      if (conn.acknowledged() && port.acks.sent(noRoom[i], now, conn.bitTime()))
+        continue;
+      trace.record(TRACE_QUEUE_FULL, pin, noRoom[i]->pocket.id);
+      backlogDone(pin);
+      delete noRoom[i];
+    }
+  }
+
+  // Queued pockets that go out in one v5 bundle with first, into
+  // port.tx.bundled. As many as the acknowledgement window has room for and
+  // fit into FRAME_MAX_BITS, taken in the order the queue gives them out.
+  uint8_t gatherBundle(PinPort &port, const Connection &conn, SendRequest *first)
+  {
+    port.tx.bundledCount = 0;
+    if (!bundleFrames || conn.version < FRAME_VERSION_5)
+      return 0;
+
+    uint8_t window = min<uint8_t>(ackWindow, ACK_WINDOW_MAX);
+    uint8_t room = window > port.acks.count + 1 ? window - port.acks.count - 1 : 0;
+    if (room > FRAME_BUNDLE_MAX - 1)
+      room = FRAME_BUNDLE_MAX - 1;
+
+    const Pocket *last = &first->pocket;
+    size_t bits = FRAME_BUNDLE_BITS + bundledBits(*last, false);
+
+    portsLock.lock();
+    while (port.tx.bundledCount < room)
+    {
+      SendRequest *req = port.queue.peek();
+      if (req == nullptr || !frameEncodable(req->pocket, conn.version))
+        break;
+      size_t more = bundledBits(req->pocket, eq(req->pocket.address, last->address));
+      if (bits + more > FRAME_MAX_BITS)
+        break;
+
+      port.tx.bundled[port.tx.bundledCount++] = port.queue.pop();
+      last = &req->pocket;
+      bits += more;
+    }
+    portsLock.unlock();
+    return port.tx.bundledCount;
+  }
+
+  PinPort *portOn(uint8_t pin)
+  {
+    for (size_t i = 0; i < portCount; i++)
+    {
+      if (ports[i]->pin() == pin)
+        return ports[i];
+    }
+    return nullptr;
+  }
+
+  // a port with edge interrupt for every connection pin
+  void syncPorts()
+  {
+    for (size_t i = 0; i < portCount;)
+    {
+      PinPort *port = ports[i];
+      bool used = false;
       for (const auto &conn : logicalNode.connections)
+        used = used || (conn.pin == port->pin() && conn.sendPin() == port->tx.pin);
+
+      // a frame we send is finished first, also one we relay while it
+      // arrives. The receiver of an unused port isn't polled any more, a
+      // frame arriving on it is dropped.
+      if (used || !port->tx.idle() || (port->rx.relay != nullptr && port->rx.relay->busy))
       {
-        if (digitalRead(conn.pin) == HIGH)
-        {
-          delayMicroseconds(BIT_DELAY * 1.4);
-          receivePocket(conn.pin);
-        }
+        i++;
+        continue;
       }
 
-      vTaskDelay(pdMS_TO_TICKS(1)); // yield
+      portsLock.lock();
+      ports[i] = ports[--portCount];
+      pinBacklog[port->pin()] = 0;
+      portsLock.unlock();
+
+      hal::detachEdgeInterrupt(port->pin());
+      if (port->duplex())
+        hal::pinMode(port->tx.pin, INPUT_PULLDOWN);
+      delete port;
+    }
+
+    for (const auto &conn : logicalNode.connections)
+    {
+      if (portOn(conn.pin) != nullptr)
+        continue;
+      if (portCount == MAX_PORTS)
+      {
+        LOG_ERROR("[Protocol] syncPorts: no port left for pin %u", conn.pin);
+        continue;
+      }
+
+      PinPort *port = new PinPort(conn.pin, conn.sendPin());
+      port->tx.detect = collisionDetect && !conn.duplex();
+      port->rx.trace = &trace;
+      hal::pinMode(conn.pin, INPUT_PULLDOWN); // stabiler gegen Rauschen
+      hal::attachEdgeInterrupt(conn.pin, EdgeCapture::onEdge, &port->rx.capture);
+      if (conn.duplex())
+      {
+        // our own line, held LOW between frames
+        hal::pinMode(conn.txPin, OUTPUT);
+        hal::digitalWrite(conn.txPin, LOW);
+      }
+
+      portsLock.lock();
+      ports[portCount++] = port;
+      portsLock.unlock();
     }
   }
 
+  // One step of the management exchange on port. The hello and the answers
+  // are sent by the TX tick, the answer to our hello is read from the
+  // captured edges, so the task never waits for the slow management bits.
+  void stepManagement(PinPort &port, Connection &conn)
+  {
+    uint32_t now = hal::micros();
+
+    switch (port.management)
+    {
+    case MANAGEMENT_HELLO:
+      if (!port.tx.done)
+        return;
+      port.tx.done = false;
+      if (!port.duplex())
+        hal::pinMode(port.pin(), INPUT_PULLDOWN);
+      if (port.tx.collided)
+      {
+        // the peer began meanwhile, tried again later
+        port.rx.resume();
+        port.management = MANAGEMENT_NONE;
+        return;
+      }
+      port.managementAt = port.tx.endedAt;
+      port.answerEdgeCount = 0;
+      port.rx.capture.clear();
+      port.rx.capture.paused = false;
+      port.management = MANAGEMENT_HELLO_ANSWER;
+      return;
+
+    case MANAGEMENT_HELLO_ANSWER:
+      if (!helloAnswered(port, conn, now))
+        return;
+      port.rx.resume(BIT_DELAY);
+      port.management = MANAGEMENT_NONE;
+      return;
+
+    case MANAGEMENT_ANSWER_DUE:
+      if ((int32_t)(now - port.managementAt) < 0)
+        return;
+      port.tx.start(nullptr, BIT_DELAY, LINE_CODE_NRZ);
+      port.management = MANAGEMENT_ANSWER;
+      return;
+
+    case MANAGEMENT_ANSWER:
+      if (!port.tx.done)
+        return;
+      port.tx.done = false;
+      if (!port.duplex())
+        hal::pinMode(port.pin(), INPUT);
+      port.rx.resume(BIT_DELAY);
+      port.management = MANAGEMENT_NONE;
+      return;
+    }
+  }
+
+  // one hello per pass, spaced by a random backoff so both ends of a
+  // connection don't send theirs at the same time
+  void negotiate()
+  {
+    if ((int32_t)(hal::millis() - nextHelloMs) < 0)
+      return;
+
+    for (auto &conn : logicalNode.connections)
+    {
+      PinPort *port = portOn(conn.pin);
+      if (conn.helloLeft == 0 || port == nullptr || !port->tx.idle() || !port->rx.idle() ||
+          port->management != MANAGEMENT_NONE)
+        continue;
+
+      // a busy line is tried again later, only unanswered hellos count
+      startHello(*port, conn);
+      break;
+    }
+
+    nextHelloMs = hal::millis() + hal::random(FRAME_HELLO_BACKOFF_BITS) * (BIT_DELAY / 1000);
+  }
+
+  // New connections and own address, from any task. While running the
+  // PhysLoop task takes them over between two passes, so the Connection
+  // pointers it works with stay valid.
+  void setConnections(vector<Connection> connections, const Address &you)
+  {
+    if (!task.started())
+    {
+      logicalNode.setConnections(connections, you);
+      return;
+    }
+
+    logicalNode.routesLock.lock();
+    pendingConnections.swap(connections);
+    pendingYou = you;
+    connectionsPending = true;
+    logicalNode.routesLock.unlock();
+  }
+
+  void takeConnections()
+  {
+    vector<Connection> next;
+    Address nextYou;
+
+    logicalNode.routesLock.lock();
+    next.swap(pendingConnections);
+    nextYou = pendingYou;
+    connectionsPending = false;
+    logicalNode.routesLock.unlock();
+
+    logicalNode.setConnections(next, nextYou);
+  }
+
   void start()
   {
-    if (taskHandle == nullptr)
+    if (!task.started())
     {
-      Serial.println("[Protocol] start: creating FreeRTOS task + queue");
-      sendQueue = xQueueCreate(8, sizeof(SendRequest *));
-      xTaskCreate(loopTask, "PhysLoop", 8192, this, 1, &taskHandle);
+      LOG_INFO("[Protocol] start: creating FreeRTOS task");
+      running = true;
+      task.start(loopTask, this, "PhysLoop", 8192);
+      txTimer.start(txTick, this, "PhysTx", TX_TICK_US);
     }
   }
 
   void stop()
   {
-    if (taskHandle != nullptr)
+    if (task.started())
+    {
+      LOG_INFO("[Protocol] stop: deleting FreeRTOS task");
+      running = false;
+      task.stop();
+    }
+    txTimer.stop();
+
+    if (connectionsPending)
+      takeConnections();
+
+    portsLock.lock();
+    size_t count = portCount;
+    portCount = 0;
+    portsLock.unlock();
+
+    for (size_t i = 0; i < count; i++)
     {
-      Serial.println("[Protocol] stop: deleting FreeRTOS task");
-      vTaskDelete(taskHandle);
-      taskHandle = nullptr;
+      hal::detachEdgeInterrupt(ports[i]->pin());
+      if (ports[i]->duplex())
+        hal::pinMode(ports[i]->tx.pin, INPUT_PULLDOWN);
+      delete ports[i];
     }
-    if (sendQueue)
+  }
+
+  // counters of every transmit queue, for any task
+  size_t queueStats(PinQueueStats *out, size_t capacity)
+  {
+    portsLock.lock();
+    size_t n = min(portCount, capacity);
+    for (size_t i = 0; i < n; i++)
     {
-      vQueueDelete(sendQueue);
-      sendQueue = nullptr;
+      const PinQueue &queue = ports[i]->queue;
+      out[i].pin = ports[i]->pin();
+      for (uint8_t c = 0; c < QUEUE_CLASSES; c++)
+      {
+        out[i].waiting[c] = queue.waiting(c);
+        out[i].highWater[c] = queue.highWater[c];
+        out[i].dropped[c] = queue.dropped[c];
+      }
+      out[i].collisions = ports[i]->backoff.collisions;
+      out[i].deferrals = ports[i]->backoff.deferrals;
+      out[i].corrected = ports[i]->rx.corrected;
     }
+    portsLock.unlock();
+    return n;
   }
 
-  void send(Address address, const char *data)
+  bool send(const Address &address, const char *data)
   {
-    Serial.println("[Protocol] send: creating and enqueueing pocket");
-    auto p = Pocket(address, data);
-    p.id = random(65535);
+    return send(address, data, strlen(data));
+  }
+
+  // Up to MESSAGE_MAX_SIZE bytes, longer than DATASIZE is sent in fragments
+  // and blocks until all of them are queued. False if it was dropped: no
+  // room in the queue of its pin or no block left in the pocket pool.
+  bool send(const Address &address, const char *data, size_t length)
+  {
+    if (length > DATASIZE)
+      return sendFragmented(address, data, length);
+
+    LOG_DEBUG("[Protocol] send: creating and enqueueing pocket");
+    uint16_t id = hal::random(65535);
+    // built in place, the queue takes the request without another copy
+    SendRequest *req = newRequest(id);
+    if (req == nullptr)
+    {
+      if (onError)
+        onError("pocket dropped, pocket pool exhausted", Pocket(address, data, length));
+      return false;
+    }
+    req->pocket = Pocket(address, data, length);
+    req->pocket.id = id;
+    trace.record(TRACE_SEND, 0, req->pocket.id);
     // Erst an logicalNode geben, entscheidet Pin oder local
-    uint8_t sendPin = logicalNode.send(p);
+    req->pin = logicalNode.send(req->pocket);
+
+    uint8_t pin = req->pin;
+    if (pin == 0 || pin == (uint8_t)-1)
+    {
+      dispatch(req->pocket, pin);
+      delete req;
+      return pin == 0;
+    }
+    if (!sendable(pin, req->pocket))
+    {
+      delete req;
+      return false;
+    }
+    return enqueueSend(req);
+  }
+
+  bool sendFragmented(const Address &address, const char *data, size_t length)
+  {
+    Pocket first(address, data, DATASIZE);
+    if (length > MESSAGE_MAX_SIZE)
+    {
+      if (onError)
+        onError("message too long", first);
+      return false;
+    }
+
+    uint8_t fragments = (length + DATASIZE - 1) / DATASIZE;
+    uint16_t message = hal::random(65535);
+    LOG_DEBUG("[Protocol] send: message of %u bytes in %u fragments", (unsigned)length, fragments);
+
+    for (uint8_t i = 0; i < fragments; i++)
+    {
+      size_t offset = i * DATASIZE;
+      SendRequest *req = newRequest(message + i, FRAGMENT_QUEUE_TIMEOUT_MS);
+      if (req == nullptr)
+      {
+        if (onError)
+          onError("message dropped, pocket pool exhausted", first);
+        return false;
+      }
+      req->pocket = Pocket(address, data + offset, min(length - offset, (size_t)DATASIZE));
+      req->pocket.fragment = i;
+      req->pocket.fragments = fragments;
+      req->pocket.id = message + i;
+      trace.record(TRACE_SEND, 0, req->pocket.id);
+
+      // routed per fragment, so they may take different equally good paths
+      req->pin = logicalNode.send(req->pocket);
+      if (req->pin == 0)
+      {
+        // for us, no need to take it apart
+        delete req;
+        if (onMessage)
+          onMessage(data, length);
+        return true;
+      }
+      if (req->pin == (uint8_t)-1)
+      {
+        if (onError)
+          onError("pocket cannot reach destination", req->pocket);
+        delete req;
+        return false;
+      }
+      if (!sendable(req->pin, req->pocket))
+      {
+        delete req;
+        return false;
+      }
+      if (!enqueueSend(req, FRAGMENT_QUEUE_TIMEOUT_MS))
+      {
+        if (onError)
+          onError("message dropped, send queue full", first);
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Sends a burst of pockets (ids are assigned here). They are routed in one
+  // pass and queued grouped by outgoing pin, so every wire gets its pockets
+  // back to back. Returns how many were delivered here or queued, the
+  // others are unreachable or found no room, like a false from send.
+  size_t sendBatch(Pocket *pockets, size_t count)
+  {
+    size_t accepted = 0;
+    uint8_t pins[SEND_BATCH_SIZE];
+    uint8_t order[SEND_BATCH_SIZE];
+
+    for (size_t offset = 0; offset < count; offset += SEND_BATCH_SIZE)
+    {
+      Pocket *batch = pockets + offset;
+      size_t n = min(count - offset, (size_t)SEND_BATCH_SIZE);
+
+      for (size_t i = 0; i < n; i++)
+      {
+        batch[i].id = hal::random(65535);
+        trace.record(TRACE_SEND, 0, batch[i].id);
+      }
+
+      logicalNode.routeBatch(batch, n, pins);
+
+      // stable insertion sort by pin
+      for (size_t i = 0; i < n; i++)
+      {
+        size_t j = i;
+        while (j > 0 && pins[order[j - 1]] > pins[i])
+        {
+          order[j] = order[j - 1];
+          j--;
+        }
+        order[j] = i;
+      }
+
+      for (size_t i = 0; i < n; i++)
+        accepted += dispatch(batch[order[i]], pins[order[i]]);
+    }
+    return accepted;
+  }
+
+  // routing result of a locally created pocket, copied only when queued.
+  // False if it is unreachable or was dropped.
+  bool dispatch(const Pocket &p, uint8_t sendPin)
+  {
     if (sendPin == 0)
     {
       if (onData)
         onData(p);
+      return true;
     }
-    else if (sendPin == (uint8_t)-1)
+    if (sendPin == (uint8_t)-1)
     {
       if (onError)
         onError("pocket cannot reach destination", p);
+      return false;
     }
-    else
-    {
-      enqueueSend(p, sendPin);
-    }
+    if (!sendable(sendPin, p))
+      return false;
+    return enqueueSend(p, sendPin);
   }
 };
 
 #include "./raw-communication.hpp"
 #include "./receive-pocket.hpp"
 #include "./send-normal-pocket.hpp"
+#include "./send-hello.hpp"
@@ -0,0 +1,149 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "./pocket.hpp"
+
+#ifndef PIN_QUEUE_SIZE
+#define PIN_QUEUE_SIZE 8 // bulk pockets waiting per connection
+#endif
+#ifndef PIN_CONTROL_QUEUE_SIZE
+#define PIN_CONTROL_QUEUE_SIZE 8 // control pockets waiting per connection
+#endif
+#define PIN_CONTROL_BURST 4 // control pockets sent in a row while bulk ones wait
+
+// Pockets that fit one frame are control traffic and go before the
+// fragments of long messages. The class follows from the pocket, so every
+// hop sorts it the same way.
+enum QueueClass : uint8_t
+{
+  QUEUE_CONTROL,
+  QUEUE_BULK,
+  QUEUE_CLASSES
+};
+
+inline uint8_t queueClassOf(const Pocket &p)
+{
+  return p.fragmented() ? QUEUE_BULK : QUEUE_CONTROL;
+}
+
+inline const char *queueClassName(uint8_t queueClass)
+{
+  return queueClass == QUEUE_CONTROL ? "control" : "bulk";
+}
+
+template <size_t N>
+struct RequestRing
+{
+  SendRequest *items[N];
+  uint8_t head = 0;
+  uint8_t count = 0;
+
+  bool full() const { return count == N; }
+
+  bool push(SendRequest *req)
+  {
+    if (full())
+      return false;
+    items[(head + count) % N] = req;
+    count++;
+    return true;
+  }
+
+  bool pushFront(SendRequest *req)
+  {
+    if (full())
+      return false;
+    head = (head + N - 1) % N;
+    items[head] = req;
+    count++;
+    return true;
+  }
+
+  SendRequest *peek() const { return count > 0 ? items[head] : nullptr; }
+
+  SendRequest *pop()
+  {
+    if (count == 0)
+      return nullptr;
+    SendRequest *req = items[head];
+    head = (head + 1) % N;
+    count--;
+    return req;
+  }
+};
+
+// Transmit queue of one connection, one ring per class. Control pockets
+// go first, but after PIN_CONTROL_BURST of them in a row a waiting bulk
+// pocket gets its turn. Only pointers move, the caller holds the lock of
+// the ports and deletes outside of it.
+struct PinQueue
+{
+  RequestRing<PIN_CONTROL_QUEUE_SIZE> control;
+  RequestRing<PIN_QUEUE_SIZE> bulk;
+  uint32_t dropped[QUEUE_CLASSES] = {};
+  uint8_t highWater[QUEUE_CLASSES] = {}; // most pockets ever waiting
+  uint8_t burst = 0;                     // control pockets sent in a row
+
+  size_t size() const { return control.count + bulk.count; }
+  bool empty() const { return size() == 0; }
+
+  bool full(uint8_t queueClass) const
+  {
+    return queueClass == QUEUE_CONTROL ? control.full() : bulk.full();
+  }
+
+  size_t waiting(uint8_t queueClass) const
+  {
+    return queueClass == QUEUE_CONTROL ? control.count : bulk.count;
+  }
+
+  // false if the ring of its class is full
+  bool push(SendRequest *req)
+  {
+    uint8_t queueClass = queueClassOf(req->pocket);
+    bool queued = queueClass == QUEUE_CONTROL ? control.push(req) : bulk.push(req);
+    if (queued && waiting(queueClass) > highWater[queueClass])
+      highWater[queueClass] = waiting(queueClass);
+    return queued;
+  }
+
+  // back to the front of its ring, a frame of it didn't go out
+  bool pushFront(SendRequest *req)
+  {
+    return queueClassOf(req->pocket) == QUEUE_CONTROL ? control.pushFront(req) : bulk.pushFront(req);
+  }
+
+  // the one pop() returns next
+  SendRequest *peek() const
+  {
+    if (control.count > 0 && (burst < PIN_CONTROL_BURST || bulk.count == 0))
+      return control.peek();
+    return bulk.peek();
+  }
+
+  SendRequest *pop()
+  {
+    if (control.count > 0 && (burst < PIN_CONTROL_BURST || bulk.count == 0))
+    {
+      burst++;
+      return control.pop();
+    }
+    burst = 0;
+    return bulk.pop();
+  }
+};
+
+// copy of the counters of one PinQueue, of the collisions on its pin (see
+// CollisionBackoff) and of the bits error correction repaired there
+struct PinQueueStats
+{
+  uint8_t pin;
+  uint8_t waiting[QUEUE_CLASSES];
+  uint8_t highWater[QUEUE_CLASSES];
+  uint32_t dropped[QUEUE_CLASSES];
+  uint32_t collisions;
+  uint32_t deferrals;
+  uint32_t corrected;
+};
@@ -0,0 +1,171 @@
+#pragma once
+
+#include "../hal/index.hpp"
+#include "./frame-encoder.hpp"
+#include "./collision-backoff.hpp"
+
+struct PinReceiver;
+
+// microseconds between two TX ticks. Every edge is up to a tick late, a
+// Manchester receiver tells a bit boundary from the middle of a bit by a
+// quarter bit time, so a tick has to be well below that.
+#define TX_TICK_US (BIT_TIMES[BIT_RATE_COUNT - 1] / 8)
+
+// Send side of one connection. The PhysLoop task encodes a frame and starts
+// it, the TX tick then puts the bit that is due on the wire, so every
+// connection can send at the same time without blocking the task.
+//
+// A relayed frame (cut-through, see PhysikalNode::startRelay) is sent while
+// it still arrives on another pin: the receiver there feeds every decoded
+// bit and ends the relay once the frame is complete. If a bit is due before
+// it arrived, or the frame turned out broken, the frame is cut off, so the
+// next hop sees it break off and drops it.
+//
+// On a shared wire (detect) the TX tick reads the line back while it holds
+// it LOW. Reading HIGH there means the peer drives it as well, the frame
+// stops as collided and the PhysLoop task backs off (see
+// CollisionBackoff).
+struct PinTransmitter
+{
+  uint8_t pin;
+  FrameBits frame;
+  SendRequest *req = nullptr; // being sent
+  SendRequest *bundled[FRAME_BUNDLE_MAX - 1]; // sent in the same frame as req
+  uint8_t bundledCount = 0;
+  uint8_t lineCode = LINE_CODE_NRZ;
+  uint32_t stepTime = 0; // a bit, or half of one in Manchester
+  uint32_t steps = 0;
+  uint32_t startedAt = 0;
+  uint32_t current = 0;
+  uint32_t endedAt = 0; // micros() after the last frame
+  volatile bool busy = false; // the TX tick owns the line while set
+  volatile bool done = false; // sent, the PhysLoop task finishes it
+
+  PinReceiver *source = nullptr;  // of the frame being relayed
+  volatile uint16_t ready = 0;    // bits of a relayed frame that arrived
+  volatile bool streaming = false; // more bits are coming
+  volatile bool cut = false;       // stop at the next tick
+  volatile bool aborted = false;   // the last frame was cut off
+  bool relaying = false;           // the frame being sent is a relay
+
+  bool detect = false;            // read the line back, see advance
+  uint8_t clashes = 0;            // HIGH reads in a row within the current step
+  volatile bool collided = false; // the last frame stopped in a collision
+
+  explicit PinTransmitter(uint8_t pin_) : pin(pin_) {}
+  ~PinTransmitter()
+  {
+    delete req;
+    for (uint8_t i = 0; i < bundledCount; i++)
+      delete bundled[i];
+  }
+
+  bool idle() const { return !busy && !done; }
+
+  // a pocket of the frame being sent
+  bool carries(uint16_t id) const
+  {
+    if (req != nullptr && req->pocket.id == id)
+      return true;
+    for (uint8_t i = 0; i < bundledCount; i++)
+    {
+      if (bundled[i]->pocket.id == id)
+        return true;
+    }
+    return false;
+  }
+
+  // the line stayed LOW for a turnaround since the last frame
+  bool rested(uint32_t now) const { return (int32_t)(now - endedAt) >= FRAME_TURNAROUND_US; }
+
+  // PhysLoop task, frame has to be encoded already
+  void start(SendRequest *request, uint32_t bitTime_, uint8_t lineCode_)
+  {
+    req = request;
+    lineCode = lineCode_;
+    stepTime = lineCode == LINE_CODE_MANCHESTER ? bitTime_ / 2 : bitTime_;
+    steps = stepsOf(frame.count);
+    current = 0;
+    clashes = 0;
+    cut = aborted = collided = relaying = false;
+    hal::pinMode(pin, OUTPUT);
+    hal::digitalWrite(pin, levelAt(0));
+    startedAt = hal::micros();
+    busy = true;
+  }
+
+  // PhysLoop task, starts sending the bits of a frame that is still
+  // arriving at from
+  void relay(PinReceiver *from, const FrameBits &arrived, uint32_t bitTime_, uint8_t lineCode_)
+  {
+    source = from;
+    frame.count = 0;
+    for (uint16_t i = 0; i < arrived.count; i++)
+      frame.push(arrived[i]);
+    ready = frame.count;
+    streaming = true;
+    start(nullptr, bitTime_, lineCode_);
+    relaying = true;
+  }
+
+  // PhysLoop task, the next bit of the relayed frame
+  void feed(bool bit)
+  {
+    frame.push(bit);
+    __sync_synchronize(); // the bit is in frame before the TX tick may read it
+    ready = frame.count;
+  }
+
+  // PhysLoop task, the relayed frame is complete
+  void endRelay()
+  {
+    source = nullptr;
+    steps = stepsOf(frame.count);
+    __sync_synchronize();
+    streaming = false;
+  }
+
+  void abort() { cut = true; }
+
+  // TX tick, writes the level that is due now
+  void advance(uint32_t now)
+  {
+    if (!busy)
+      return;
+
+    uint32_t index = (now - startedAt) / stepTime;
+    if (!cut && index < (streaming ? stepsOf(ready) : steps))
+    {
+      if (index != current)
+      {
+        current = index;
+        clashes = 0;
+        hal::digitalWrite(pin, levelAt(index));
+        return;
+      }
+      if (!detect || levelAt(index))
+        return;
+      clashes = hal::digitalRead(pin) == HIGH ? clashes + 1 : 0;
+      if (clashes < COLLISION_READS)
+        return;
+      collided = true;
+    }
+
+    hal::digitalWrite(pin, LOW);
+    aborted = cut || streaming || (collided && relaying);
+    endedAt = now;
+    busy = false;
+    done = true;
+  }
+
+private:
+  uint32_t stepsOf(uint32_t bits) const { return lineCode == LINE_CODE_MANCHESTER ? bits * 2 : bits; }
+
+  // level of a bit, or of a half bit in Manchester (see frame.hpp)
+  bool levelAt(uint32_t step) const
+  {
+    if (lineCode == LINE_CODE_MANCHESTER)
+      return frame[step / 2] == (step & 1);
+    return frame[step];
+  }
+};
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "../hal/index.hpp"
+
+#ifndef POCKET_POOL_SIZE
+#define POCKET_POOL_SIZE 64 // SendRequests in flight per node, sent, queued or being received
+#endif
+#define POCKET_POOL_RESERVE 8 // blocks only receivers take, see SendRequest::operator new
+
+// Fixed blocks of every SendRequest, so no pocket touches the heap after
+// boot. A block is taken and given back in a few stores under a spinlock (a
+// critical section on the esp32, safe from interrupts too). An empty pool
+// makes new return nullptr, the caller turns that into backpressure.
+struct PocketPool
+{
+  union Block
+  {
+    Block *next; // while free
+    alignas(SendRequest) uint8_t bytes[sizeof(SendRequest)];
+  };
+
+  Block blocks[POCKET_POOL_SIZE];
+  Block *freeList;
+  volatile size_t used = 0;
+  volatile size_t highWater = 0; // most blocks ever used at once
+  volatile uint32_t failures = 0; // blocks asked for and refused
+  hal::Spinlock lock;
+
+  PocketPool()
+  {
+    for (size_t i = 0; i + 1 < POCKET_POOL_SIZE; i++)
+      blocks[i].next = &blocks[i + 1];
+    blocks[POCKET_POOL_SIZE - 1].next = nullptr;
+    freeList = blocks;
+  }
+
+  size_t available() const { return POCKET_POOL_SIZE - used; }
+
+  // a block while more than keep are free, nullptr otherwise
+  void *allocate(size_t keep)
+  {
+    Block *block = nullptr;
+    lock.lock();
+    if (POCKET_POOL_SIZE - used > keep)
+    {
+      block = freeList;
+      freeList = block->next;
+      if (++used > highWater)
+        highWater = used;
+    }
+    else
+    {
+      failures++;
+    }
+    lock.unlock();
+    return block;
+  }
+
+  void release(void *pointer)
+  {
+    if (pointer == nullptr)
+      return;
+    Block *block = static_cast<Block *>(pointer);
+    lock.lock();
+    block->next = freeList;
+    freeList = block;
+    used--;
+    lock.unlock();
+  }
+};
+
+// one per firmware, shared by every PhysikalNode of the host simulation
+inline PocketPool &pocketPool()
+{
+  static PocketPool pool;
+  return pool;
+}
+
+// Senders leave POCKET_POOL_RESERVE blocks to the receivers, which need one
+// for every frame, acknowledgements included.
+inline void *SendRequest::operator new(size_t) noexcept
+{
+  return pocketPool().allocate(POCKET_POOL_RESERVE);
+}
+
+inline void *SendRequest::operator new(size_t, PoolUse use) noexcept
+{
+  return pocketPool().allocate(use == POOL_RECEIVE ? 0 : POCKET_POOL_RESERVE);
+}
+
+inline void SendRequest::operator delete(void *block) noexcept
+{
+  pocketPool().release(block);
+}
+
+inline void SendRequest::operator delete(void *block, PoolUse) noexcept
+{
+  pocketPool().release(block);
+}
@@ -2,32 +2,68 @@
 
 #include <cstring>
 
-#define DATASIZE 16
+#define DATASIZE 32 // largest payload of one frame
 
 struct Pocket
 {
     Address address;
-    char data[DATASIZE + 1];
-    uint16_t checksum;
+    char data[DATASIZE + 1]; // length bytes, then '\0'
+    uint8_t length;
+    uint8_t fragment;  // index within its message
+    uint8_t fragments; // of the message, 0 or 1 if it isn't fragmented
     uint16_t id;
 
-    Pocket(Address a, const char *d) : address(a)
+    // empty pocket that a frame is decoded into
+    Pocket() : length(0), fragment(0), fragments(0), id(0)
     {
-        // Fill with spaces first
-        memset(data, ' ', DATASIZE);
+        data[0] = '\0';
+    }
 
-        // Copy up to DATASIZE characters from d
-        size_t len = strlen(d);
-        size_t copyLen = len > DATASIZE ? DATASIZE : len;
-        memcpy(data, d, copyLen);
+    Pocket(const Address &a, const char *d) : Pocket(a, d, strlen(d)) {}
 
-        // Null-terminate only if there's room (optional depending on expected use)
-        data[DATASIZE] = '\0';
+    // takes up to DATASIZE bytes of d
+    Pocket(const Address &a, const char *d, size_t len) : address(a), fragment(0), fragments(0), id(0)
+    {
+        length = len > DATASIZE ? DATASIZE : len;
+        memcpy(data, d, length);
+        data[length] = '\0';
+    }
+
+#ifdef POCKET_COUNT_COPIES
+    // host benchmarks only, every copy of a pocket counts
+    static size_t &copies()
+    {
+        static size_t count = 0;
+        return count;
+    }
 
-        checksum = calculateChecksum();
+    Pocket(const Pocket &other)
+        : address(other.address), length(other.length), fragment(other.fragment), fragments(other.fragments),
+          id(other.id)
+    {
+        memcpy(data, other.data, sizeof(data));
+        copies()++;
     }
 
-    uint16_t calculateChecksum() const
+    Pocket &operator=(const Pocket &other)
+    {
+        address = other.address;
+        memcpy(data, other.data, sizeof(data));
+        length = other.length;
+        fragment = other.fragment;
+        fragments = other.fragments;
+        id = other.id;
+        copies()++;
+        return *this;
+    }
+#endif
+
+    bool fragmented() const { return fragments > 1; }
+
+    // Fletcher sum of frames up to v3, v4 frames carry a CRC (see frame.hpp).
+    // The data counts as padded with spaces to padTo bytes, as v1 and v2
+    // frames send it.
+    uint16_t calculateChecksum(uint8_t padTo = 0) const
     {
         uint16_t sum1 = 0;
         uint16_t sum2 = 0;
@@ -40,11 +76,25 @@ struct Pocket
         }
 
         // Add data bytes
-        for (int i = 0; i < DATASIZE; i++)
+        for (int i = 0; i < length; i++)
         {
             sum1 = (sum1 + static_cast<uint8_t>(data[i])) % 255;
             sum2 = (sum2 + sum1) % 255;
         }
+        for (int i = length; i < padTo; i++)
+        {
+            sum1 = (sum1 + ' ') % 255;
+            sum2 = (sum2 + sum1) % 255;
+        }
+
+        // and where the fragment belongs
+        if (fragmented())
+        {
+            sum1 = (sum1 + fragment) % 255;
+            sum2 = (sum2 + sum1) % 255;
+            sum1 = (sum1 + fragments) % 255;
+            sum2 = (sum2 + sum1) % 255;
+        }
 
         return ((sum2 << 8) | sum1) ^ address.size(); // Combine sums into one 16-bit checksum xor with the adress length
     }
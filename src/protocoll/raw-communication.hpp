@@ -1,39 +1,17 @@
 #pragma once
 
-#define BIT_DELAY 50000
+#define BIT_DELAY 50000 // management frames and v1 connections
 
-#include <Arduino.h>
+// Bit times in microseconds a v2 connection can negotiate, slowest first.
+// Neighbours agree on the slower of their BIT_RATE_FASTEST and step down
+// after BIT_RATE_MAX_FAILURES unreadable frames in a row. All but the first
+// have to stay below BIT_DELAY / 4 (see frame.hpp).
+#define BIT_RATE_COUNT 6
+static const uint32_t BIT_TIMES[BIT_RATE_COUNT] = {BIT_DELAY, 10000, 5000, 2000, 1000, 500};
 
-uint8_t readByte(uint8_t pin)
-{
-    uint8_t value = 0;
-    for (int i = 0; i < 8; i++)
-    {
-        value |= (digitalRead(pin) << (7 - i));
-        delayMicroseconds(BIT_DELAY);
-    }
-    return value;
-}
+#ifndef BIT_RATE_FASTEST
+#define BIT_RATE_FASTEST (BIT_RATE_COUNT - 1)
+#endif
+#define BIT_RATE_MAX_FAILURES 3
 
-uint16_t readUInt16(uint8_t pin)
-{
-    uint8_t low = readByte(pin);
-    uint8_t high = readByte(pin);
-    return (high << 8) | low;
-}
-
-void sendByte(uint8_t pin, uint8_t byte)
-{
-    for (int i = 7; i >= 0; i--)
-    {
-        digitalWrite(pin, (byte >> i) & 1);
-        delayMicroseconds(BIT_DELAY);
-    }
-    digitalWrite(pin, LOW);
-}
-
-void sendUInt16(uint8_t pin, uint16_t val)
-{
-    sendByte(pin, val & 0xFF);
-    sendByte(pin, val >> 8);
-}
\ No newline at end of file
+#include "../hal/index.hpp"
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "./pocket.hpp"
+
+#define MESSAGE_MAX_SIZE 1024 // longest message send() takes, in bytes
+#define MESSAGE_MAX_FRAGMENTS ((MESSAGE_MAX_SIZE + DATASIZE - 1) / DATASIZE)
+
+#define REASSEMBLY_SLOTS 2          // messages reassembled at once
+#define REASSEMBLY_TIMEOUT_MS 60000 // a message is dropped after this long without a fragment
+
+// A message longer than DATASIZE is sent as fragments of DATASIZE bytes (the
+// last one shorter) with consecutive ids. Fragment i has id = first id + i,
+// so id - fragment is the same for all of them and names the message.
+struct ReassemblySlot
+{
+  bool used = false;
+  uint16_t message = 0;
+  uint8_t fragments = 0;
+  uint8_t received = 0;
+  uint32_t have[(MESSAGE_MAX_FRAGMENTS + 31) / 32] = {};
+  uint32_t lastMs = 0; // millis() of the newest fragment
+  size_t length = 0;   // known once the last fragment arrived
+  char data[MESSAGE_MAX_SIZE + 1];
+
+  bool complete() const { return used && received == fragments; }
+};
+
+struct Reassembly
+{
+  ReassemblySlot slots[REASSEMBLY_SLOTS];
+  volatile uint32_t expired = 0; // messages given up on
+  volatile uint32_t dropped = 0; // fragments that found no slot or didn't fit
+
+  // Stores fragment p, returns its slot once the message is complete. The
+  // caller hands the slot back with release().
+  ReassemblySlot *add(const Pocket &p, uint32_t nowMs)
+  {
+    expire(nowMs);
+
+    if (p.fragments > MESSAGE_MAX_FRAGMENTS || p.fragment >= p.fragments ||
+        (p.fragment + 1 < p.fragments && p.length != DATASIZE))
+    {
+      dropped++;
+      return nullptr;
+    }
+
+    uint16_t message = p.id - p.fragment;
+    ReassemblySlot *slot = nullptr;
+    ReassemblySlot *unused = nullptr;
+    for (ReassemblySlot &s : slots)
+    {
+      if (s.used && s.message == message && s.fragments == p.fragments)
+        slot = &s;
+      else if (!s.used && unused == nullptr)
+        unused = &s;
+    }
+
+    if (slot == nullptr)
+    {
+      if (unused == nullptr)
+      {
+        dropped++;
+        return nullptr;
+      }
+      slot = unused;
+      slot->used = true;
+      slot->message = message;
+      slot->fragments = p.fragments;
+      slot->received = 0;
+      slot->length = 0;
+      memset(slot->have, 0, sizeof(slot->have));
+    }
+
+    slot->lastMs = nowMs;
+
+    uint32_t bit = 1u << (p.fragment % 32);
+    if (slot->have[p.fragment / 32] & bit)
+      return nullptr; // already there
+
+    slot->have[p.fragment / 32] |= bit;
+    slot->received++;
+    memcpy(slot->data + p.fragment * DATASIZE, p.data, p.length);
+    if (p.fragment + 1 == p.fragments)
+      slot->length = p.fragment * DATASIZE + p.length;
+
+    if (!slot->complete())
+      return nullptr;
+
+    slot->data[slot->length] = '\0';
+    return slot;
+  }
+
+  void release(ReassemblySlot *slot) { slot->used = false; }
+
+  // drops messages that stopped arriving
+  void expire(uint32_t nowMs)
+  {
+    for (ReassemblySlot &s : slots)
+    {
+      if (s.used && nowMs - s.lastMs > REASSEMBLY_TIMEOUT_MS)
+      {
+        s.used = false;
+        expired++;
+      }
+    }
+  }
+};
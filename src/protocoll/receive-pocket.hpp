@@ -2,149 +2,338 @@
 
 #include "./physikal.hpp"
 
-#define IGNORE_ID_POOL_SIZE 16
-uint16_t ignorePoolIds[IGNORE_ID_POOL_SIZE];
-size_t ignorePoolIndex = 0;
-
-void PhysikalNode::handleMenagementFrame(uint8_t pin)
+// The answer starts 1.4 bit times after the request, as the old polling
+// receiver did. A request decoded too late for that, or while we are
+// sending on the pin, is left unanswered, so is one that claims to end
+// later (a garbled frame, after a collision say). The answer is encoded
+// here and sent by the TX tick (see stepManagement) on the transmit line
+// of the port, txPin of a two-wire connection.
+void PhysikalNode::handleMenagementFrame(PinPort &port, SendRequest *req)
 {
-    bool type = digitalRead(pin);
-    delayMicroseconds(BIT_DELAY);
+    PinReceiver &rx = port.rx;
+    uint8_t pin = rx.pin();
+    FrameBits &bits = port.tx.frame;
+    bool type = rx.frame.connectRequest;
+    uint32_t answerAt = rx.frameEnd() + BIT_DELAY * 1.4;
+
+    LOG_INFO("[Protocol] management frame on pin %u: %s", pin, type ? "Connect Request" : "Adress Request");
 
-    Serial.println("Receaved Data Frame");
-    Serial.println(type ? "Connect Request" : "Adress Request");
+    int32_t late = hal::micros() - answerAt;
+    if (late > BIT_DELAY * 2 || late < -BIT_DELAY * 2 || !port.tx.idle())
+    {
+        LOG_ERROR("[Protocol] management frame on pin %u can't be answered", pin);
+        delete req;
+        return;
+    }
+    rx.pause();
+
+    // start = LOW, HIGH
+    bits.clear();
+    bits.push(0);
+    bits.push(1);
 
     if (type == 1) // Connect Request
     {
-        // get Address
-        Address address;
+        // get Address, elements past ADDRESS_MAX_DEPTH come first
+        Address &address = req->pocket.address;
+        const FrameDecoder &frame = rx.frame;
+        uint8_t overflow = frame.overflowCount;
+        auto last = [&]() -> uint16_t
+        { return overflow > 0 ? frame.overflow[overflow - 1] : address[address.size() - 1]; };
+        auto dropLast = [&]()
+        {
+            if (overflow > 0)
+                overflow--;
+            else
+                address.pop_back();
+        };
+        bool tooDeep = frame.tooDeep;
 
-        while (true)
+        // hello from the peer of an existing connection (see send-hello.hpp),
+        // addresses never hold FRAME_HELLO_MARKER or above
+        bool isHello = !tooDeep && !address.empty() && (last() & 0xFF00) == FRAME_HELLO_MARKER;
+        uint8_t helloVersion = 0;
+        uint8_t helloRate = 0;
+        uint8_t helloLineCode = LINE_CODE_NRZ;
+        bool helloFec = false;
+        Connection *helloConnection = nullptr;
+
+        if (isHello)
         {
-            auto v = readUInt16(pin);
-            if (v == 0)
-                break;
-            address.push_back(v);
+            helloVersion = last() & 0x7F;
+            helloFec = last() & FRAME_HELLO_FEC;
+            dropLast();
+            if (helloVersion >= FRAME_VERSION_2 && !address.empty())
+            {
+                uint16_t offer = last();
+                helloRate = min<uint16_t>(offer & 0xFF, BIT_RATE_COUNT - 1);
+                helloLineCode = min<uint16_t>((offer & ~FRAME_HELLO_OFFER) >> 8, LINE_CODE_MANCHESTER);
+                dropLast();
+            }
         }
 
-        // sen ok, adress back
-        delayMicroseconds(BIT_DELAY);
-        pinMode(pin, OUTPUT);
-        // start = LOW, HIGH
-        digitalWrite(pin, LOW);
-        delayMicroseconds(BIT_DELAY);
-        digitalWrite(pin, HIGH);
-        delayMicroseconds(BIT_DELAY);
+        // only the offer and marker of a hello fit past ADDRESS_MAX_DEPTH
+        tooDeep = tooDeep || overflow > 0;
 
-        bool ok = true;
+        if (isHello && !tooDeep)
+        {
+            for (auto &connection : logicalNode.connections)
+            {
+                if (connection.pin == pin && eq(connection.address, address))
+                    helloConnection = &connection;
+            }
+        }
 
-        for (const auto &connection : logicalNode.connections)
+        bool ok = !tooDeep;
+
+        if (isHello)
+        {
+            ok = helloConnection != nullptr && helloVersion >= FRAME_VERSION_2;
+        }
+        else
         {
-            if (eq(connection.address, address) || connection.pin == pin)
+            for (const auto &connection : logicalNode.connections)
             {
-                ok = false;
-                break;
+                if (eq(connection.address, address) || connection.pin == pin)
+                {
+                    ok = false;
+                    break;
+                }
             }
         }
 
-        digitalWrite(pin, ok);
-        delayMicroseconds(BIT_DELAY);
+        bits.push(ok);
+
+        bool ended = false;
+        if (helloConnection != nullptr)
+        {
+            uint8_t version = ok ? min<uint8_t>(helloVersion, FRAME_VERSION_MAX) : FRAME_VERSION_1;
+            uint8_t rate = ok ? min(helloRate, helloConnection->rateCap) : 0;
+            uint8_t lineCode = ok ? min(helloLineCode, helloConnection->lineCodeCap) : LINE_CODE_NRZ;
+            bool fec = ok && helloFec && helloConnection->fecCap;
+
+            // agreed version, error correction, line code and rate after ok, it ends LOW and
+            // the peer may send right after it, so we listen again without
+            // the end bit
+            if (ok)
+            {
+                bits.pushByte((version - FRAME_VERSION_2) << 6 | fec << 5 | lineCode << 4 | rate);
+                ended = true;
+            }
+
+            helloConnection->version = version;
+            helloConnection->rate = rate;
+            helloConnection->lineCode = lineCode;
+            helloConnection->fec = fec;
+            helloConnection->checksumFailures = 0;
+            helloConnection->helloLeft = 0;
 
-        if (ok)
+            LOG_INFO("[Protocol] hello on pin %u: frame version %u, %u us per bit, %s%s", pin,
+                     helloConnection->version, (unsigned)helloConnection->bitTime(),
+                     lineCodeName(helloConnection->dataLineCode()), fec ? ", error correction" : "");
+        }
+        else if (ok)
         {
-            logicalNode.connections.push_back(Connection{address, pin});
+            vector<Connection> next = logicalNode.connections;
+            next.push_back(Connection{address, pin});
+            logicalNode.setConnections(next, logicalNode.you);
         }
 
-        // LOW = END
-        delayMicroseconds(BIT_DELAY);
-        digitalWrite(pin, LOW);
-        pinMode(pin, INPUT);
+        // ok is held for another bit, LOW = END
+        if (!ended)
+            bits.push(ok);
     }
 
     if (type == 0) // Adress Request
     {
-        // sen ok, adress back
-        delayMicroseconds(BIT_DELAY);
-        pinMode(pin, OUTPUT);
-        // start = LOW, HIGH
-        digitalWrite(pin, LOW);
-        delayMicroseconds(BIT_DELAY);
-        digitalWrite(pin, HIGH);
-        delayMicroseconds(BIT_DELAY);
-
         // address
         for (auto a : logicalNode.you)
         {
-            sendUInt16(pin, a);
+            bits.pushUInt16(a);
         }
-        sendUInt16(pin, 0); // End of address marker
+        bits.pushUInt16(0); // End of address marker
 
         // LOW = END
-        delayMicroseconds(BIT_DELAY);
-        digitalWrite(pin, LOW);
-        pinMode(pin, INPUT);
+        bits.push(0);
     }
+
+    port.managementAt = answerAt;
+    port.management = MANAGEMENT_ANSWER_DUE;
+    delete req;
 }
 
-void PhysikalNode::receivePocket(uint8_t pin)
+// A data frame of the peer on conn that we couldn't read. After
+// BIT_RATE_MAX_FAILURES in a row the connection negotiates again: one rate
+// less if the wire was too fast for it, and at any rate when both ends
+// settled on different versions (a misread hello answer).
+void PhysikalNode::frameFailed(Connection *conn, uint8_t pin)
 {
-    bool isDataFrame = digitalRead(pin);
-    delayMicroseconds(BIT_DELAY);
+    if (conn == nullptr || conn->helloLeft > 0 || ++conn->checksumFailures < BIT_RATE_MAX_FAILURES)
+        return;
+
+    LOG_INFO("[Protocol] receivePocket: negotiating again on pin %u", pin);
+    if (conn->rate > 0)
+        conn->rateCap = conn->rate - 1;
+    conn->checksumFailures = 0;
+    conn->helloLeft = FRAME_HELLO_ATTEMPTS;
+}
+
+// checks a decoded data frame and takes ownership of req. relay is the
+// transmitter that sends it on already (see startRelay), it gets req once
+// the frame turned out fine and is cut off otherwise. The pockets of a
+// bundle come one by one, each checked against its own CRC.
+void PhysikalNode::receivePocket(PinPort &port, SendRequest *req, const FrameDecoder &frame, PinTransmitter *relay)
+{
+    Pocket &p = req->pocket;
+    uint8_t pin = port.pin();
+    bool tooDeep = frame.tooDeep;
+    bool knownVersion = frame.knownVersion;
 
-    // Meanagement
-    if (!isDataFrame)
+    if (relay != nullptr && !(knownVersion && !tooDeep && !frame.tooLong && frame.checksumOk()))
     {
-        handleMenagementFrame(pin);
-        return;
+        LOG_DEBUG("[Protocol] receivePocket: cutting off the relay on pin %u", relay->pin);
+        relay->abort();
+        relay = nullptr;
     }
 
-    Address address;
+    Connection *conn = logicalNode.connectionOn(pin);
 
-    while (true)
+    if (!knownVersion)
     {
-        auto v = readUInt16(pin);
-        if (v == 0)
-            break;
-        address.push_back(v);
+        LOG_DEBUG("[Protocol] receivePocket: unknown frame version");
+        trace.record(TRACE_UNKNOWN_VERSION, pin, p.id);
+        frameFailed(conn, pin);
+
+        if (onError != nullptr)
+            onError("Unknown frame version!", p);
+        delete req;
+        return;
     }
 
-    char data[DATASIZE + 1];
-    for (int i = 0; i < DATASIZE; i++)
+    if (tooDeep)
     {
-        data[i] = readByte(pin);
+        LOG_DEBUG("[Protocol] receivePocket: address too deep");
+        trace.record(TRACE_TOO_DEEP, pin, p.id);
+        frameFailed(conn, pin);
+
+        if (onError != nullptr)
+            onError("Address too deep!", p);
+        delete req;
+        return;
     }
-    data[DATASIZE] = '\0';
 
-    uint16_t id = readUInt16(pin);
-    uint16_t checksum = readUInt16(pin);
+    if (frame.tooLong)
+    {
+        LOG_DEBUG("[Protocol] receivePocket: payload too long");
+        trace.record(TRACE_TOO_LONG, pin, p.id);
 
-    Pocket p(address, data);
-    p.id = id;
+        if (onError != nullptr)
+            onError("Payload too long!", p);
+        delete req;
+        return;
+    }
 
-    if (p.checksum != checksum)
+    if (!frame.checksumOk())
     {
-        Serial.println("[Protocol] receivePocket: checksum mismatch");
+        LOG_DEBUG("[Protocol] receivePocket: checksum mismatch");
+        trace.record(TRACE_CHECKSUM_ERROR, pin, p.id);
+        frameFailed(conn, pin);
 
         if (onError != nullptr)
         {
             onError("Checksum mismatch! Data:", p);
-            onError(data, p);
+            onError(p.data, p);
         }
+        delete req;
+        return;
+    }
+
+    if (conn != nullptr)
+        conn->checksumFailures = 0;
+
+    if (frame.ack)
+    {
+        receiveAck(port, p);
+        delete req;
+        return;
+    }
+
+    uint8_t sendPin = relay != nullptr ? relay->pin : logicalNode.recieve(p);
+
+    // Queued pockets leave half of the pool reserve to the receivers.
+    bool queueRoom = true, room = true;
+    if (sendPin != 0 && sendPin != (uint8_t)-1 && relay == nullptr)
+    {
+        queueRoom = !queueFull(sendPin, p);
+        room = queueRoom && pocketPool().available() >= POCKET_POOL_RESERVE / 2;
+    }
+
+    // a copy is acknowledged as well, the sender may have missed the first
+    if (duplicates.seen(p.address, p.id, hal::millis(), room))
+    {
+        LOG_DEBUG("[Protocol] receivePocket: duplicate pocket, ignoring");
+        trace.record(TRACE_DUPLICATE, pin, p.id);
+        if (conn != nullptr && conn->acknowledged())
+            port.acks.expect(p.id);
+        delete req;
+        return;
+    }
+
+    // no room to forward a new one, left unacknowledged and not remembered
+    // the sender tries again later
+    if (!room)
+    {
+        LOG_DEBUG("[Protocol] receivePocket: no room to forward via pin %u, dropping", sendPin);
+        trace.record(queueRoom ? TRACE_POOL_EMPTY : TRACE_QUEUE_FULL, sendPin, p.id);
+        delete req;
+        return;
+    }
+
+    if (conn != nullptr && conn->acknowledged())
+        port.acks.expect(p.id);
+
+    LOG_DEBUG("[Protocol] receivePocket: checksum valid");
+    trace.record(TRACE_RECEIVE, pin, p.id);
+
+    if (relay != nullptr)
+    {
+        // on the wire already, finished like any pocket sent on sendPin
+        LOG_DEBUG("[Protocol] receivePocket: relayed via pin %u", sendPin);
+        trace.record(TRACE_FORWARD, sendPin, p.id);
+        req->pin = sendPin;
+        req->attempts = 1;
+        portsLock.lock();
+        pinBacklog[sendPin]++;
+        portsLock.unlock();
+        relay->req = req;
         return;
     }
+    on(req, sendPin);
+}
 
-    for (size_t i = 0; i < IGNORE_ID_POOL_SIZE; i++)
+// the ids in ack were received by the peer
+void PhysikalNode::receiveAck(PinPort &port, const Pocket &ack)
+{
+    uint8_t pin = port.pin();
+    uint32_t now = hal::micros();
+
+    for (uint8_t i = 0; i + 1 < ack.length; i += 2)
     {
-        if (ignorePoolIds[i] == id)
+        uint16_t id = uint8_t(ack.data[i]) | uint8_t(ack.data[i + 1]) << 8;
+        SendRequest *req = port.acks.take(id, now);
+        if (req == nullptr)
         {
-            Serial.println("[Protocol] receivePocket: duplicate pocket, ignoring");
-            return;
+            if (port.tx.carries(id))
+                port.acks.acknowledgedEarly(id);
+            continue; // acknowledged before, or given up
         }
-    }
 
-    ignorePoolIds[ignorePoolIndex] = id;
-    ignorePoolIndex = (ignorePoolIndex + 1) % IGNORE_ID_POOL_SIZE;
+        LOG_DEBUG("[Protocol] receiveAck: pocket %u acknowledged on pin %u", id, pin);
+        trace.record(TRACE_ACKED, pin, id, req->attempts);
+        backlogDone(pin);
+        delete req;
+    }
 
-    Serial.println("[Protocol] receivePocket: checksum valid");
-    on(p);
-}
\ No newline at end of file
+    // the peer is done, our next frame only waits for the turnaround
+    port.acks.slotUntil = now;
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+// Direct mapped cache of routing verdicts per destination. An entry is only
+// valid for the epoch it was stored in, Node::setConnections bumps the epoch so
+// every change to connections or you drops the whole cache at once. Not locked
+// itself, its only user Node::routeBatch holds Node::routesLock around every
+// lookup and store.
+
+#ifndef ROUTE_CACHE_SIZE
+#define ROUTE_CACHE_SIZE 16 // power of two
+#endif
+
+struct RouteCacheEntry
+{
+  uint32_t epoch = 0; // 0 = never stored
+  uint32_t hash = 0;
+  Address destination;
+  Route route;
+};
+
+struct RouteCache
+{
+  RouteCacheEntry entries[ROUTE_CACHE_SIZE];
+  uint32_t hits = 0;
+  uint32_t misses = 0;
+
+  // FNV-1a over the address elements
+  static uint32_t hash(const Address &address)
+  {
+    uint32_t h = 2166136261u;
+    for (uint16_t part : address)
+    {
+      h = (h ^ (part & 0xFF)) * 16777619u;
+      h = (h ^ (part >> 8)) * 16777619u;
+    }
+    return h ^ address.size();
+  }
+
+  bool lookup(const Address &destination, uint32_t hash, uint32_t epoch, Route &route)
+  {
+    const RouteCacheEntry &e = entries[hash & (ROUTE_CACHE_SIZE - 1)];
+    if (e.epoch == epoch && e.hash == hash && eq(e.destination, destination))
+    {
+      route = e.route;
+      hits++;
+      return true;
+    }
+    misses++;
+    return false;
+  }
+
+  void store(const Address &destination, uint32_t hash, uint32_t epoch, const Route &route)
+  {
+    RouteCacheEntry &e = entries[hash & (ROUTE_CACHE_SIZE - 1)];
+    e.epoch = epoch;
+    e.hash = hash;
+    e.destination = destination;
+    e.route = route;
+  }
+};
@@ -0,0 +1,293 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+
+using namespace std;
+
+// Prefix trie compiled from Node::connections.
+//
+// A connection scores matchIndex = positive - negative = 2 * positive - length
+// against a destination. All connections that leave the destination's path at
+// the same depth share `positive`, so per depth only the shortest one (first
+// connection on equal length) can win. Every trie node therefore stores the
+// best connection of its subtree plus the best one outside of its best child,
+// and a lookup walks the destination once: O(address depth).
+//
+// Equal scores go to the longer address. The scan in the first Node::send
+// compared against the length of the last tie winner rather than the current
+// best, that stale length is deliberately not reproduced (see `bench
+// routes`). Connections that tie on score and length are equally good next
+// hops, each trie node keeps up to MULTIPATH_MAX_PATHS of them (lowest index
+// first) for load balancing.
+
+#define ROUTE_NONE 0xFFFFFFFF
+#define ROUTE_TERMINAL 0xFFFFFFFE
+
+#ifndef MULTIPATH_MAX_PATHS
+#define MULTIPATH_MAX_PATHS 4
+#endif
+
+struct RouteCandidate
+{
+  uint16_t length;
+  uint16_t index;
+
+  RouteCandidate() : length(0xFFFF), index(0xFFFF) {}
+  RouteCandidate(uint16_t length_, uint16_t index_) : length(length_), index(index_) {}
+
+  bool valid() const { return index != 0xFFFF; }
+
+  bool betterThan(const RouteCandidate &other) const
+  {
+    if (length != other.length)
+      return length < other.length;
+    return index < other.index;
+  }
+};
+
+struct RouteGroupEntry
+{
+  uint16_t index;
+  uint32_t source; // child it comes from or ROUTE_TERMINAL
+};
+
+struct RouteTrieNode
+{
+  uint16_t key = 0;
+  uint16_t childCount = 0;
+  uint32_t firstChild = 0; // children are stored contiguously, sorted by key
+
+  RouteCandidate best;              // best connection in this subtree
+  uint32_t bestSource = ROUTE_NONE; // child holding `best` or ROUTE_TERMINAL
+  RouteCandidate second;            // best connection not coming from bestSource
+
+  // connections as good as best / second, ranges in RoutingTable::groups
+  uint32_t bestGroup = 0;
+  uint8_t bestGroupCount = 0;
+  uint32_t secondGroup = 0;
+  uint8_t secondGroupCount = 0;
+};
+
+struct RoutingTable
+{
+  vector<RouteTrieNode> nodes;
+  vector<RouteGroupEntry> groups;
+  size_t connectionCount = 0;
+
+  size_t size() const { return connectionCount; }
+
+  void swap(RoutingTable &other)
+  {
+    nodes.swap(other.nodes);
+    groups.swap(other.groups);
+    std::swap(connectionCount, other.connectionCount);
+  }
+
+  void build(const vector<Connection> &connections)
+  {
+    nodes.clear();
+    groups.clear();
+    connectionCount = connections.size();
+    if (connections.empty())
+      return;
+
+    vector<uint16_t> order(connections.size());
+    for (size_t i = 0; i < order.size(); i++)
+      order[i] = i;
+
+    stable_sort(order.begin(), order.end(), [&](uint16_t a, uint16_t b)
+                { return lexicographical_compare(connections[a].address.begin(), connections[a].address.end(),
+                                                 connections[b].address.begin(), connections[b].address.end()); });
+
+    nodes.push_back(RouteTrieNode());
+    buildNode(0, connections, order, 0, order.size(), 0);
+  }
+
+  // Up to MULTIPATH_MAX_PATHS equally good next hops (indices into
+  // connections, lowest first) into paths, returns how many. score receives
+  // their matchIndex.
+  size_t lookup(const Address &destination, uint16_t *paths, int *score = nullptr) const
+  {
+    if (nodes.empty())
+      return 0;
+
+    RouteCandidate best;
+    int bestScore = 0;
+    uint32_t bestNode = 0;
+    uint32_t bestExcluded = ROUTE_NONE;
+
+    uint32_t current = 0;
+    size_t depth = 0;
+
+    while (true)
+    {
+      const RouteTrieNode &node = nodes[current];
+      uint32_t next = depth < destination.size() ? findChild(node, destination[depth]) : ROUTE_NONE;
+
+      // connections leaving the destination's path at this depth
+      const RouteCandidate &candidate = node.bestSource != next ? node.best : node.second;
+
+      if (candidate.valid())
+      {
+        int score = 2 * (int)depth - candidate.length;
+        if (!best.valid() || score > bestScore || (score == bestScore && candidate.length > best.length))
+        {
+          best = candidate;
+          bestScore = score;
+          bestNode = current;
+          bestExcluded = next;
+        }
+      }
+
+      if (next == ROUTE_NONE)
+        break;
+
+      current = next;
+      depth++;
+    }
+
+    if (!best.valid())
+      return 0;
+
+    if (score)
+      *score = bestScore;
+
+    const RouteTrieNode &node = nodes[bestNode];
+    if (node.bestSource == bestExcluded)
+    {
+      for (size_t i = 0; i < node.secondGroupCount; i++)
+        paths[i] = groups[node.secondGroup + i].index;
+      return node.secondGroupCount;
+    }
+
+    size_t count = 0;
+    for (size_t i = 0; i < node.bestGroupCount; i++)
+    {
+      const RouteGroupEntry &entry = groups[node.bestGroup + i];
+      if (entry.source != bestExcluded)
+        paths[count++] = entry.index;
+    }
+    return count;
+  }
+
+private:
+  struct Offer
+  {
+    RouteCandidate candidate;
+    uint32_t source;
+  };
+
+  uint32_t findChild(const RouteTrieNode &node, uint16_t key) const
+  {
+    uint32_t lo = node.firstChild;
+    uint32_t hi = node.firstChild + node.childCount;
+
+    while (lo < hi)
+    {
+      uint32_t mid = lo + (hi - lo) / 2;
+      if (nodes[mid].key < key)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+
+    if (lo < node.firstChild + node.childCount && nodes[lo].key == key)
+      return lo;
+    return ROUTE_NONE;
+  }
+
+  // appends the lowest indices of offers with the given length (skipping
+  // one source) to groups
+  uint8_t appendGroup(vector<Offer> &offers, uint16_t length, uint32_t skipSource)
+  {
+    size_t begin = groups.size();
+    for (const Offer &o : offers)
+    {
+      if (o.candidate.length == length && o.source != skipSource)
+        groups.push_back(RouteGroupEntry{o.candidate.index, o.source});
+    }
+
+    sort(groups.begin() + begin, groups.end(), [](const RouteGroupEntry &a, const RouteGroupEntry &b)
+         { return a.index < b.index; });
+
+    if (groups.size() - begin > MULTIPATH_MAX_PATHS)
+      groups.resize(begin + MULTIPATH_MAX_PATHS);
+    return groups.size() - begin;
+  }
+
+  // `order` is sorted, so [begin, end) holds every connection below this node
+  void buildNode(uint32_t self, const vector<Connection> &connections, const vector<uint16_t> &order,
+                 size_t begin, size_t end, size_t depth)
+  {
+    vector<Offer> offers;
+
+    // connections ending exactly here sort first, the stable sort keeps them by index
+    size_t i = begin;
+    while (i < end && connections[order[i]].address.size() == depth)
+    {
+      if (offers.size() < MULTIPATH_MAX_PATHS)
+        offers.push_back(Offer{RouteCandidate(depth, order[i]), ROUTE_TERMINAL});
+      i++;
+    }
+
+    // one child per distinct address element at this depth
+    size_t childCount = 0;
+    for (size_t j = i; j < end; j++)
+    {
+      if (j == i || connections[order[j]].address[depth] != connections[order[j - 1]].address[depth])
+        childCount++;
+    }
+
+    uint32_t firstChild = nodes.size();
+    nodes[self].firstChild = firstChild;
+    nodes[self].childCount = childCount;
+    nodes.resize(nodes.size() + childCount);
+
+    uint32_t child = firstChild;
+    size_t groupBegin = i;
+    for (size_t j = i + 1; j <= end; j++)
+    {
+      if (j < end && connections[order[j]].address[depth] == connections[order[groupBegin]].address[depth])
+        continue;
+
+      nodes[child].key = connections[order[groupBegin]].address[depth];
+      buildNode(child, connections, order, groupBegin, j, depth + 1);
+
+      const RouteTrieNode &c = nodes[child];
+      for (size_t k = 0; k < c.bestGroupCount; k++)
+        offers.push_back(Offer{RouteCandidate(c.best.length, groups[c.bestGroup + k].index), child});
+
+      child++;
+      groupBegin = j;
+    }
+
+    RouteTrieNode &node = nodes[self];
+    for (const Offer &o : offers)
+    {
+      if (!node.best.valid() || o.candidate.betterThan(node.best))
+      {
+        node.best = o.candidate;
+        node.bestSource = o.source;
+      }
+    }
+    for (const Offer &o : offers)
+    {
+      if (o.source != node.bestSource && (!node.second.valid() || o.candidate.betterThan(node.second)))
+        node.second = o.candidate;
+    }
+
+    node.bestGroup = groups.size();
+    node.bestGroupCount = appendGroup(offers, node.best.length, ROUTE_NONE);
+    node.secondGroup = groups.size();
+    node.secondGroupCount = node.second.valid() ? appendGroup(offers, node.second.length, node.bestSource) : 0;
+  }
+};
+
+// routing verdict for one destination, no paths = the pocket stays here
+struct Route
+{
+  uint8_t count = 0;
+  uint16_t paths[MULTIPATH_MAX_PATHS] = {}; // equally good connections, lowest index first
+  int16_t score = 0;
+};
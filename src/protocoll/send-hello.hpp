@@ -0,0 +1,131 @@
+#pragma once
+
+#include "./physikal.hpp"
+
+// Connect request for a pin that already has a connection, our address is
+// followed by the fastest rate and line code we offer and FRAME_HELLO_MARKER
+// | our version (| FRAME_HELLO_FEC). A v1 peer rejects it because the pin is
+// taken, a newer peer accepts it and answers the frame version, rate, line
+// code and error correction both sides switch to. Returns false if the line
+// is busy, the TX tick sends the hello otherwise and helloAnswered reads the
+// answer. On a two-wire connection the hello goes out on txPin and the
+// answer comes back on pin.
+bool PhysikalNode::startHello(PinPort &port, const Connection &connection)
+{
+    uint8_t pin = connection.pin;
+
+    if (hal::digitalRead(pin) == HIGH)
+        return false; // line busy
+
+    LOG_DEBUG("[Protocol] startHello: on pin %u", pin);
+
+    // the answer is read from the captured edges, not by the receiver
+    port.rx.pause();
+
+    FrameBits &bits = port.tx.frame;
+    bits.clear();
+    bits.push(1); // start signal
+    bits.push(0); // management frame
+    bits.push(1); // connect request
+    for (auto a : logicalNode.you)
+    {
+        bits.pushUInt16(a);
+    }
+    bits.pushUInt16(FRAME_HELLO_OFFER | connection.lineCodeCap << 8 | connection.rateCap);
+    bits.pushUInt16(FRAME_HELLO_MARKER | (connection.fecCap ? FRAME_HELLO_FEC : 0) | FRAME_VERSION_MAX);
+    bits.pushUInt16(0); // End of address marker
+
+    port.tx.start(nullptr, BIT_DELAY, LINE_CODE_NRZ);
+    port.management = MANAGEMENT_HELLO;
+    return true;
+}
+
+// level of the line at time t, from the edges captured since our hello
+bool answerLevel(const PinPort &port, uint32_t t)
+{
+    bool level = LOW;
+    for (uint8_t i = 0; i < port.answerEdgeCount; i++)
+    {
+        if ((int32_t)((port.answerEdges[i] & ~1u) - t) > 0)
+            break;
+        level = port.answerEdges[i] & 1;
+    }
+    return level;
+}
+
+// answer: LOW, HIGH, ok, (version - 2) << 6 | fec << 5 | line code << 4
+// | rate if ok (see handleMenagementFrame), each bit is sampled in its
+// middle once every edge up to there is captured. True once the hello is
+// answered or given up.
+bool PhysikalNode::helloAnswered(PinPort &port, Connection &connection, uint32_t now)
+{
+    uint8_t pin = connection.pin;
+    uint32_t edge;
+    while (port.rx.capture.peek(edge))
+    {
+        if (port.answerEdgeCount < HELLO_ANSWER_EDGES)
+            port.answerEdges[port.answerEdgeCount++] = edge;
+        port.rx.capture.drop();
+    }
+
+    uint32_t risenAt = 0;
+    bool risen = false;
+    for (uint8_t i = 0; i < port.answerEdgeCount && !risen; i++)
+    {
+        risen = port.answerEdges[i] & 1;
+        risenAt = port.answerEdges[i] & ~1u;
+    }
+
+    if (!risen)
+    {
+        if (now - port.managementAt < BIT_DELAY * 6 + EDGE_SETTLE_US)
+            return false;
+        if (--connection.helloLeft == 0)
+            LOG_INFO("[Protocol] negotiate: no answer on pin %u, staying at v1", pin);
+        return true;
+    }
+
+    uint32_t okAt = risenAt + BIT_DELAY * 3 / 2;
+    if ((int32_t)(now - okAt) < EDGE_SETTLE_US)
+        return false;
+    bool ok = answerLevel(port, okAt);
+
+    // a misread ok bit must not leave us at v1 while the peer switched
+    if (!ok && --connection.helloLeft > 0)
+    {
+        LOG_DEBUG("[Protocol] helloAnswered: refused on pin %u, asking again", pin);
+        return true;
+    }
+
+    uint8_t rate = 0;
+    uint8_t lineCode = LINE_CODE_NRZ;
+    bool fec = false;
+    uint8_t version = FRAME_VERSION_1;
+    if (ok)
+    {
+        // the answer ends LOW after the byte, the peer may send right after
+        uint32_t endAt = risenAt + BIT_DELAY * 10;
+        if ((int32_t)(now - endAt) < EDGE_SETTLE_US)
+            return false;
+
+        uint8_t agreed = 0;
+        for (int i = 1; i <= 8; i++)
+            agreed = agreed << 1 | answerLevel(port, okAt + BIT_DELAY * i);
+        rate = min<uint8_t>(agreed & 0x0F, connection.rateCap);
+        lineCode = min<uint8_t>((agreed >> 4) & 0x01, connection.lineCodeCap);
+        fec = (agreed >> 5) & 0x01 && connection.fecCap;
+        version = min<uint8_t>(FRAME_VERSION_2 + (agreed >> 6), FRAME_VERSION_MAX);
+    }
+
+    connection.version = version;
+    connection.helloLeft = 0;
+    connection.rate = rate;
+    connection.lineCode = lineCode;
+    connection.fec = fec;
+    connection.checksumFailures = 0;
+
+    LOG_INFO("[Protocol] helloAnswered: pin %u speaks frame version %u, %u us per bit, %s%s", pin,
+             connection.version, (unsigned)connection.bitTime(), lineCodeName(connection.dataLineCode()),
+             connection.fec ? ", error correction" : "");
+    return true;
+}
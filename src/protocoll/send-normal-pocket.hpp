@@ -2,36 +2,200 @@
 
 #include "./physikal.hpp"
 
-void PhysikalNode::sendNormalPocket(Pocket &p, uint8_t pin)
+// Starts sending req on its port, the TX tick does the rest. Takes ownership
+// of req.
+void PhysikalNode::sendNormalPocket(PinPort &port, const Connection &conn, SendRequest *req)
 {
-    Serial.print("[Protocol] sendNormalPocket: sending on pin ");
-    Serial.println(pin);
+    Pocket &p = req->pocket;
+    uint8_t pin = port.pin();
 
-    pinMode(pin, OUTPUT);
-    // start signal
-    digitalWrite(pin, HIGH);
-    delayMicroseconds(BIT_DELAY);
-    // data frame
-    digitalWrite(pin, HIGH);
-    delayMicroseconds(BIT_DELAY);
+    LOG_DEBUG("[Protocol] sendNormalPocket: sending on pin %u", pin);
 
-    for (auto a : p.address)
+    // a new connection speaks v1 until its hello is over, the pocket waits
+    // for it at the front of the queue
+    if (!frameEncodable(p, conn.version) && conn.helloLeft > 0 && frameEncodable(p, FRAME_VERSION_MAX))
     {
-        sendUInt16(pin, a);
+        portsLock.lock();
+        bool queued = port.queue.pushFront(req);
+        portsLock.unlock();
+        if (!queued)
+        {
+            trace.record(TRACE_QUEUE_FULL, pin, p.id);
+            backlogDone(pin);
+            delete req;
+        }
+        return;
     }
-    sendUInt16(pin, 0); // End of address marker
 
-    for (int i = 0; i < DATASIZE; i++)
+    // a peer without v3 gets the first FRAME_FIXED_DATASIZE bytes
+    if (conn.version < FRAME_VERSION_3 && p.length > FRAME_FIXED_DATASIZE && frameSendable(p, conn.version))
     {
-        sendByte(pin, p.data[i]);
+        LOG_DEBUG("[Protocol] sendNormalPocket: data cut to %u bytes for a v%u frame", FRAME_FIXED_DATASIZE,
+                  conn.version);
+        p.length = FRAME_FIXED_DATASIZE;
+        p.data[p.length] = '\0';
     }
 
-    sendUInt16(pin, p.id);
+    if (!frameEncodable(p, conn.version))
+    {
+        LOG_ERROR("[Protocol] sendNormalPocket: pocket can't be sent as v%u frame", conn.version);
+        if (onError != nullptr)
+            onError("Pocket not encodable for this connection", p);
+        backlogDone(pin);
+        delete req;
+        return;
+    }
 
-    sendUInt16(pin, p.checksum);
+    uint8_t bundled = gatherBundle(port, conn, req);
+    if (bundled == 0)
+    {
+        encodeFrame(p, conn.version, port.tx.frame);
+    }
+    else
+    {
+        const Pocket *pockets[FRAME_BUNDLE_MAX] = {&p};
+        for (uint8_t i = 0; i < bundled; i++)
+        {
+            pockets[i + 1] = &port.tx.bundled[i]->pocket;
+            port.tx.bundled[i]->attempts++;
+        }
+        LOG_DEBUG("[Protocol] sendNormalPocket: %u pockets in one bundle", bundled + 1);
+        encodeBundle(pockets, bundled + 1, port.tx.frame);
+        bundlesSent++;
+        pocketsBundled += bundled + 1;
+    }
+    if (conn.fec)
+        protectFrame(port.tx.frame);
+    req->attempts++;
 
-    pinMode(pin, INPUT); // Switch back to receive mode
+    // the peer may have begun since the line was found free
+    if (port.tx.detect && port.carrier())
+    {
+        LOG_DEBUG("[Protocol] sendNormalPocket: carrier on pin %u, holding back", pin);
+        trace.record(TRACE_CARRIER, pin, p.id);
+        port.backoff.deferrals++;
+        requeueFront(port, conn, req);
+        return;
+    }
+
+    if (!port.duplex())
+        port.rx.pause();
+    port.tx.start(req, conn.bitTime(), conn.dataLineCode());
+}
 
-    Serial.print("[Protocol] sendNormalPocket: queued packet with checksum ");
-    Serial.println(p.checksum, HEX);
+// Acknowledges every pending id in one frame.
+void PhysikalNode::sendAck(PinPort &port, const Connection &conn)
+{
+    if (port.tx.detect && port.carrier())
+    {
+        port.backoff.deferrals++;
+        return; // after the frame of the peer
+    }
+
+    Pocket ack;
+    for (uint8_t i = 0; i < port.acks.pendingCount; i++)
+    {
+        ack.data[2 * i] = port.acks.pending[i] & 0xFF;
+        ack.data[2 * i + 1] = port.acks.pending[i] >> 8;
+    }
+    ack.length = 2 * port.acks.pendingCount;
+    ack.data[ack.length] = '\0';
+    port.acks.pendingCount = 0;
+
+    LOG_DEBUG("[Protocol] sendAck: acknowledging %u pockets on pin %u", ack.length / 2, port.pin());
+
+    encodeFrame(ack, conn.version, port.tx.frame, FRAME_ACK);
+    if (conn.fec)
+        protectFrame(port.tx.frame);
+
+    if (!port.duplex())
+        port.rx.pause();
+    port.tx.start(nullptr, conn.bitTime(), conn.dataLineCode());
+}
+
+// A sent pocket, and every other one of its bundle, waits for its
+// acknowledgement on an acknowledged connection, elsewhere it is done.
+void PhysikalNode::finishNormalPocket(PinPort &port, const Connection &conn)
+{
+    SendRequest *req = port.tx.req;
+    uint8_t pin = port.pin();
+
+    port.tx.req = nullptr;
+    port.tx.done = false;
+
+    // a relay cut off while its frame still arrives, the receiver there
+    // stores and forwards it instead
+    if (port.tx.source != nullptr)
+    {
+        port.tx.source->relay = nullptr;
+        port.tx.source = nullptr;
+    }
+
+    // a two-wire connection kept receiving meanwhile
+    if (!port.duplex())
+    {
+        hal::pinMode(pin, INPUT_PULLDOWN); // Switch back to receive mode
+        port.rx.resume();
+    }
+
+    if (port.tx.collided)
+    {
+        LOG_DEBUG("[Protocol] finishNormalPocket: collision on pin %u", pin);
+        port.backoff.collided(hal::micros(), conn.bitTime());
+        trace.record(TRACE_COLLISION, pin, req != nullptr ? req->pocket.id : 0, port.backoff.inRow);
+    }
+    else if (!port.tx.aborted)
+    {
+        port.backoff.sent();
+    }
+
+    if (port.tx.aborted)
+    {
+        LOG_DEBUG("[Protocol] finishNormalPocket: relay on pin %u cut off", pin);
+        trace.record(TRACE_CUT_OFF, pin, req != nullptr ? req->pocket.id : 0);
+        relaysCut++;
+        if (req == nullptr)
+            return;
+
+        // complete and fine, but too late for the relay: it waits its turn
+        req->attempts = 0;
+        portsLock.lock();
+        bool queued = port.queue.push(req);
+        portsLock.unlock();
+        if (!queued)
+        {
+            trace.record(TRACE_QUEUE_FULL, pin, req->pocket.id);
+            backlogDone(pin);
+            delete req;
+        }
+        return;
+    }
+
+    // an acknowledgement, or a relayed copy of a pocket seen before. A
+    // collided acknowledgement is lost, the peer sends its pockets again.
+    if (req == nullptr)
+        return;
+
+    if (port.tx.collided)
+    {
+        requeueFront(port, conn, req);
+        return;
+    }
+
+    uint8_t bundled = port.tx.bundledCount;
+    port.tx.bundledCount = 0;
+
+    for (uint8_t i = 0; i <= bundled; i++)
+    {
+        SendRequest *sent = i == 0 ? req : port.tx.bundled[i - 1];
+
+        LOG_DEBUG("[Protocol] sendNormalPocket: sent pocket %u", sent->pocket.id);
+        trace.record(TRACE_TRANSMIT, pin, sent->pocket.id);
+
+        if (conn.acknowledged() && port.acks.sent(sent, hal::micros(), conn.bitTime()))
+            continue;
+
+        backlogDone(pin);
+        delete sent;
+    }
 }
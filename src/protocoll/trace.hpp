@@ -0,0 +1,150 @@
+#pragma once
+
+#include "../hal/index.hpp"
+
+// Fixed size binary trace of per pocket events. Recording is a few stores
+// under a spinlock, nothing is formatted or printed from the routing loop.
+// Readers drain it whenever they like (see /trace in the web interface).
+
+#ifndef TRACE_ENABLED
+#define TRACE_ENABLED 1
+#endif
+
+#ifndef TRACE_RING_SIZE
+#define TRACE_RING_SIZE 128
+#endif
+
+enum TraceEvent : uint8_t
+{
+  TRACE_SEND = 1,        // pocket created locally
+  TRACE_ROUTE,           // next hop chosen, score = matchIndex
+  TRACE_DELIVER,         // handed to onData
+  TRACE_UNREACHABLE,     // no way to the destination
+  TRACE_FORWARD,         // queued for another pin
+  TRACE_QUEUE_FULL,      // dropped, send queue full
+  TRACE_TRANSMIT,        // frame put on the wire
+  TRACE_RECEIVE,         // frame read with valid checksum
+  TRACE_CHECKSUM_ERROR,  // frame read with checksum mismatch
+  TRACE_DUPLICATE,       // frame ignored, id seen before
+  TRACE_ACKED,           // acknowledged by the next hop, score = attempts
+  TRACE_RETRANSMIT,      // not acknowledged in time, sent again
+  TRACE_UNACKED,         // dropped after MAX_ATTEMPTS
+  TRACE_POOL_EMPTY,      // refused, no block left in the pocket pool
+  TRACE_CUT_THROUGH,     // sent on while it arrives, pin = outgoing
+  TRACE_CUT_OFF,         // relay stopped within the frame
+  TRACE_COLLISION,       // our frame collided with one of the peer, score = collisions in a row
+  TRACE_CARRIER,         // held back, the peer had just begun a frame
+  TRACE_BROKE_OFF,       // Manchester frame stopped within, dropped
+  TRACE_EDGE_OVERFLOW,   // edges came faster than they were decoded, frame dropped
+  TRACE_UNKNOWN_VERSION, // frame dropped, version not understood
+  TRACE_TOO_DEEP,        // frame dropped, address deeper than ADDRESS_MAX_DEPTH
+  TRACE_TOO_LONG,        // frame dropped, payload longer than DATASIZE
+};
+
+inline const char *traceEventName(uint8_t event)
+{
+  switch (event)
+  {
+  case TRACE_SEND:
+    return "send";
+  case TRACE_ROUTE:
+    return "route";
+  case TRACE_DELIVER:
+    return "deliver";
+  case TRACE_UNREACHABLE:
+    return "unreachable";
+  case TRACE_FORWARD:
+    return "forward";
+  case TRACE_QUEUE_FULL:
+    return "queue-full";
+  case TRACE_TRANSMIT:
+    return "transmit";
+  case TRACE_RECEIVE:
+    return "receive";
+  case TRACE_CHECKSUM_ERROR:
+    return "checksum-error";
+  case TRACE_DUPLICATE:
+    return "duplicate";
+  case TRACE_ACKED:
+    return "acked";
+  case TRACE_RETRANSMIT:
+    return "retransmit";
+  case TRACE_UNACKED:
+    return "unacked";
+  case TRACE_POOL_EMPTY:
+    return "pool-empty";
+  case TRACE_CUT_THROUGH:
+    return "cut-through";
+  case TRACE_CUT_OFF:
+    return "cut-off";
+  case TRACE_COLLISION:
+    return "collision";
+  case TRACE_CARRIER:
+    return "carrier";
+  case TRACE_BROKE_OFF:
+    return "broke-off";
+  case TRACE_EDGE_OVERFLOW:
+    return "edge-overflow";
+  case TRACE_UNKNOWN_VERSION:
+    return "unknown-version";
+  case TRACE_TOO_DEEP:
+    return "too-deep";
+  case TRACE_TOO_LONG:
+    return "too-long";
+  default:
+    return "?";
+  }
+}
+
+struct TraceRecord
+{
+  uint32_t time; // micros()
+  uint8_t event;
+  uint8_t pin;
+  uint16_t pocketId;
+  int16_t score;
+};
+
+struct TraceRing
+{
+  TraceRecord records[TRACE_RING_SIZE];
+  uint32_t head = 0;    // records ever written
+  uint32_t tail = 0;    // records ever drained
+  uint32_t dropped = 0; // overwritten before they were drained
+  hal::Spinlock lock;
+
+  void record(uint8_t event, uint8_t pin, uint16_t pocketId, int16_t score = 0)
+  {
+#if TRACE_ENABLED
+    uint32_t now = hal::micros();
+    lock.lock();
+    TraceRecord &r = records[head % TRACE_RING_SIZE];
+    r.time = now;
+    r.event = event;
+    r.pin = pin;
+    r.pocketId = pocketId;
+    r.score = score;
+    head++;
+    if (head - tail > TRACE_RING_SIZE)
+    {
+      dropped += head - tail - TRACE_RING_SIZE;
+      tail = head - TRACE_RING_SIZE;
+    }
+    lock.unlock();
+#endif
+  }
+
+  // copies up to max of the oldest undrained records to out and forgets them
+  size_t drain(TraceRecord *out, size_t max)
+  {
+    size_t n = 0;
+    lock.lock();
+    while (n < max && tail != head)
+    {
+      out[n++] = records[tail % TRACE_RING_SIZE];
+      tail++;
+    }
+    lock.unlock();
+    return n;
+  }
+};
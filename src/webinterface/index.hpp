@@ -111,11 +111,15 @@ private:
 
     void setupRoutes()
     {
-        physikalNode.onData = [&](Pocket pocket)
+        physikalNode.onData = [&](const Pocket &pocket)
         {
             messages.push_back(pocket.data);
         };
-        physikalNode.onError = [&](String error, Pocket pocket)
+        physikalNode.onMessage = [&](const char *data, size_t)
+        {
+            messages.push_back(data);
+        };
+        physikalNode.onError = [&](const char *error, const Pocket &)
         {
             errors.push_back(error);
         };
@@ -148,6 +152,66 @@ private:
 
             server.send(200, "text/plain", messages.c_str());
         });
+        server.on("/trace", HTTP_GET, [&]() { //
+            TraceRecord records[32];
+            String out = "dropped " + String(physikalNode.trace.dropped) + "\n";
+            out += "time_us event pin id score\n";
+
+            size_t n;
+            while ((n = physikalNode.trace.drain(records, 32)) > 0)
+            {
+                for (size_t i = 0; i < n; i++)
+                {
+                    out += String(records[i].time) + " " + traceEventName(records[i].event) + " " +
+                           String(records[i].pin) + " " + String(records[i].pocketId) + " " +
+                           String(records[i].score) + "\n";
+                }
+            }
+
+            server.send(200, "text/plain", out.c_str());
+        });
+        server.on("/stats", HTTP_GET, [&]() { //
+            const Node &node = physikalNode.logicalNode;
+            String out;
+            out += "route cache hits " + String(node.cache.hits) + "\n";
+            out += "route cache misses " + String(node.cache.misses) + "\n";
+            out += "route epoch " + String(node.epoch) + "\n";
+            out += "retransmissions " + String(physikalNode.retransmits) + "\n";
+            out += "unacknowledged " + String(physikalNode.unacknowledged) + "\n";
+            out += "cut-through " + String(physikalNode.cutThrough ? "on" : "off") + "\n";
+            out += "frames relayed " + String(physikalNode.relayed) + "\n";
+            out += "relays cut off " + String(physikalNode.relaysCut) + "\n";
+            out += "bundles sent " + String(physikalNode.bundlesSent) + "\n";
+            out += "pockets bundled " + String(physikalNode.pocketsBundled) + "\n";
+            out += "duplicates dropped " + String(physikalNode.duplicates.duplicates) + "\n";
+            out += "duplicates forgotten early " + String(physikalNode.duplicates.evicted) + "\n";
+            out += "messages expired " + String(physikalNode.reassembly.expired) + "\n";
+            out += "fragments dropped " + String(physikalNode.reassembly.dropped) + "\n";
+
+            const PocketPool &pool = pocketPool();
+            out += "pocket pool size " + String(POCKET_POOL_SIZE) + "\n";
+            out += "pocket pool used " + String(pool.used) + "\n";
+            out += "pocket pool high watermark " + String(pool.highWater) + "\n";
+            out += "pocket pool failures " + String(pool.failures) + "\n";
+
+            PinQueueStats queues[MAX_PORTS];
+            size_t n = physikalNode.queueStats(queues, MAX_PORTS);
+            for (size_t i = 0; i < n; i++)
+            {
+                for (uint8_t c = 0; c < QUEUE_CLASSES; c++)
+                {
+                    String prefix = "pin " + String(queues[i].pin) + " " + queueClassName(c) + " queue ";
+                    out += prefix + "waiting " + String(queues[i].waiting[c]) + "\n";
+                    out += prefix + "high watermark " + String(queues[i].highWater[c]) + "\n";
+                    out += prefix + "dropped " + String(queues[i].dropped[c]) + "\n";
+                }
+                out += "pin " + String(queues[i].pin) + " collisions " + String(queues[i].collisions) + "\n";
+                out += "pin " + String(queues[i].pin) + " frames held back " + String(queues[i].deferrals) + "\n";
+                out += "pin " + String(queues[i].pin) + " bits corrected " + String(queues[i].corrected) + "\n";
+            }
+
+            server.send(200, "text/plain", out.c_str());
+        });
         server.onNotFound([&]()
                           { server.send(404, "text/plain", "Not Found"); });
 
@@ -155,6 +219,23 @@ private:
                   { server.send(204, "text/plain", ""); });
     }
 
+    // "1,2,3" -> {1, 2, 3}, false if it is deeper than ADDRESS_MAX_DEPTH or
+    // holds an element reserved for the hello (FRAME_HELLO_MARKER and above)
+    static bool parseAddress(const String &text, Address &out)
+    {
+        out.clear();
+        std::istringstream ss(text.c_str());
+        uint16_t v;
+        while (ss >> v)
+        {
+            if (v >= FRAME_HELLO_MARKER || !out.push_back(v))
+                return false;
+            if (ss.peek() == ',')
+                ss.ignore();
+        }
+        return true;
+    }
+
     // Helper to build server URL
     String getServerURL()
     {
@@ -172,7 +253,7 @@ private:
     {
         Serial.println("[Web] handleConnectionsSave");
         String ownAddr;
-        std::vector<String> addrs, pins;
+        std::vector<String> addrs, pins, txPins, codes, fecs;
 
         // Process parameters
         for (int i = 0; i < server.args(); ++i)
@@ -189,41 +270,57 @@ private:
             {
                 pins.push_back(server.arg(i));
             }
+            else if (server.argName(i) == "txpin[]")
+            {
+                txPins.push_back(server.arg(i));
+            }
+            else if (server.argName(i) == "code[]")
+            {
+                codes.push_back(server.arg(i));
+            }
+            else if (server.argName(i) == "fec[]")
+            {
+                fecs.push_back(server.arg(i));
+            }
         }
 
         // Update Own Address
+        vector<Connection> connections;
+        Address you;
+        physikalNode.logicalNode.copyConnections(connections, you);
         if (!ownAddr.isEmpty())
         {
             Address newAddr;
-            std::istringstream ss(ownAddr.c_str());
-            uint16_t v;
-            while (ss >> v)
+            if (!parseAddress(ownAddr, newAddr))
             {
-                newAddr.push_back(v);
-                if (ss.peek() == ',')
-                    ss.ignore();
+                server.send(400, "text/plain", "Invalid own address");
+                return;
             }
-            physikalNode.logicalNode.you = newAddr;
+            you = newAddr;
         }
 
         // Update Connections
-        physikalNode.logicalNode.connections.clear();
+        connections.clear();
         for (size_t i = 0; i < addrs.size() && i < pins.size(); ++i)
         {
             Connection c;
-            std::istringstream ss(addrs[i].c_str());
-            uint16_t v;
-            while (ss >> v)
+            if (!parseAddress(addrs[i], c.address))
             {
-                c.address.push_back(v);
-                if (ss.peek() == ',')
-                    ss.ignore();
+                server.send(400, "text/plain", "Invalid connection address: " + addrs[i]);
+                return;
             }
             c.pin = uint8_t(pins[i].toInt());
-            physikalNode.logicalNode.connections.push_back(c);
+            if (i < txPins.size())
+                c.txPin = uint8_t(txPins[i].toInt()); // empty or 0: the same wire
+            if (i < codes.size())
+                c.lineCodeCap = uint8_t(codes[i].toInt());
+            if (i < fecs.size())
+                c.fecCap = fecs[i].toInt() != 0;
+            connections.push_back(c);
         }
 
-        saveConnections();
+        saveConnections(connections, you);
+        physikalNode.setConnections(connections, you);
         server.sendHeader("Location", "/connections");
         server.send(302, "text/plain", "");
     }
@@ -257,23 +354,25 @@ private:
         }
 
         Address address;
-        std::istringstream ss(rawAddress.c_str());
-        uint16_t v;
-        while (ss >> v)
+        if (!parseAddress(rawAddress, address))
         {
-            address.push_back(v);
-            if (ss.peek() == ',')
-                ss.ignore();
+            server.send(400, "text/plain", "Invalid address");
+            return;
         }
 
         // Ensure message is not too long
-        if (rawMsg.length() > DATASIZE)
+        if (rawMsg.length() > MESSAGE_MAX_SIZE)
         {
-            rawMsg = rawMsg.substring(0, DATASIZE);
+            server.send(400, "text/plain", "Message too long");
+            return;
         }
 
-        // Send the message
-        physikalNode.send(address, rawMsg.c_str());
+        // Send the message, longer ones in fragments
+        if (!physikalNode.send(address, rawMsg.c_str(), rawMsg.length()))
+        {
+            server.send(503, "text/plain", "Message dropped, unreachable or the node is busy");
+            return;
+        }
 
         String html = R"(
             <!DOCTYPE html>
@@ -389,11 +488,14 @@ private:
         Serial.println("[Web] handleConnections: scan");
 
         // Build Own Address section
+        vector<Connection> connections;
+        Address you;
+        physikalNode.logicalNode.copyConnections(connections, you);
         String ownAddrStr;
-        for (size_t i = 0; i < physikalNode.logicalNode.you.size(); ++i)
+        for (size_t i = 0; i < you.size(); ++i)
         {
-            ownAddrStr += String(physikalNode.logicalNode.you[i]);
-            if (i + 1 < physikalNode.logicalNode.you.size())
+            ownAddrStr += String(you[i]);
+            if (i + 1 < you.size())
             {
                 ownAddrStr += ",";
             }
@@ -401,7 +503,7 @@ private:
 
         // Build connection rows
         String connectionRows;
-        for (auto &c : physikalNode.logicalNode.connections)
+        for (auto &c : connections)
         {
             String a;
             for (size_t i = 0; i < c.address.size(); ++i)
@@ -418,6 +520,22 @@ private:
                               a + R"(' class='form-input'></td>
                     <td><input type='number' name='pin[]' value=')" +
                               String(c.pin) + R"(' class='form-input'></td>
+                    <td><input type='number' name='txpin[]' value=')" +
+                              (c.duplex() ? String(c.txPin) : String("")) + R"(' placeholder='same' class='form-input'></td>
+                    <td>)" + (c.helloLeft ? String("?") : String("v") + String(c.version)) +
+                              R"(</td>
+                    <td>)" + String(1000000 / c.bitTime()) +
+                              R"( bit/s</td>
+                    <td><select name='code[]' class='form-input'>
+                        <option value='0')" + (c.lineCodeCap == LINE_CODE_NRZ ? " selected" : "") + R"(>NRZ</option>
+                        <option value='1')" + (c.lineCodeCap == LINE_CODE_MANCHESTER ? " selected" : "") + R"(>Manchester</option>
+                    </select> )" + (c.helloLeft ? String("") : String(lineCodeName(c.dataLineCode()))) +
+                              R"(</td>
+                    <td><select name='fec[]' class='form-input'>
+                        <option value='0')" + (!c.fecCap ? " selected" : "") + R"(>Off</option>
+                        <option value='1')" + (c.fecCap ? " selected" : "") + R"(>Hamming</option>
+                    </select> )" + (c.helloLeft ? String("") : String(c.fec ? "on" : "off")) +
+                              R"(</td>
                     <td><button type='button' onclick='removeRow(this)' class='btn-danger btn'>Remove</button></td>
                 </tr>)";
         }
@@ -581,6 +699,11 @@ private:
                             <tr>
                                 <th>Address</th>
                                 <th>Pin</th>
+                                <th>TX Pin</th>
+                                <th>Frame</th>
+                                <th>Rate</th>
+                                <th>Line Code</th>
+                                <th>FEC</th>
                                 <th>Actions</th>
                             </tr>
                         </thead>
@@ -610,6 +733,17 @@ private:
             const row = document.createElement('tr');
             row.innerHTML = ` <td><input name = "address[]" class = "form-input"></ td>
                 <td><input type = "number" name = "pin[]" class = "form-input"></ td>
+                <td><input type = "number" name = "txpin[]" placeholder = "same" class = "form-input"></ td>
+                <td>?</td>
+                <td>?</td>
+                <td><select name = "code[]" class = "form-input">
+                    <option value = "0">NRZ</option>
+                    <option value = "1" selected>Manchester</option>
+                </select></td>
+                <td><select name = "fec[]" class = "form-input">
+                    <option value = "0">Off</option>
+                    <option value = "1">Hamming</option>
+                </select></td>
                 <td><button type = "button" onclick = "removeRow(this) " class
             = "btn-danger btn" > Remove</ button></ td>
             `;
@@ -718,13 +852,15 @@ private:
     void loadConnections()
     {
         Serial.println("[Web] loadConnections");
-        physikalNode.logicalNode.connections.clear();
+        vector<Connection> connections;
+        Address you;
 
         if (!LittleFS.exists(CONN_FILE))
         {
             File f = LittleFS.open(CONN_FILE, "w");
             if (f)
                 f.close();
+            physikalNode.setConnections(connections, you);
             return;
         }
 
@@ -749,55 +885,63 @@ private:
                 {
                     // Load Own Address
                     Address addr;
-                    std::istringstream ss(as.c_str());
-                    uint16_t v;
-                    while (ss >> v)
-                    {
-                        addr.push_back(v);
-                        if (ss.peek() == ',')
-                            ss.ignore();
-                    }
-                    physikalNode.logicalNode.you = addr;
+                    if (!parseAddress(as, addr))
+                        Serial.printf("[Web] invalid own address, ignored: %s\n", as.c_str());
+                    else
+                        you = addr;
                     firstLine = false;
                 }
                 else
                 {
                     // Load Connection
                     Connection c;
-                    std::istringstream ss(as.c_str());
-                    uint16_t v;
-                    while (ss >> v)
+                    if (!parseAddress(as, c.address))
                     {
-                        c.address.push_back(v);
-                        if (ss.peek() == ',')
-                            ss.ignore();
+                        Serial.printf("[Web] invalid connection address, skipped: %s\n", as.c_str());
+                        continue;
                     }
                     c.pin = uint8_t(ps.toInt());
-                    physikalNode.logicalNode.connections.push_back(c);
+                    int q = ps.indexOf(':'); // line code, missing in older files
+                    if (q >= 0)
+                    {
+                        String rest = ps.substring(q + 1);
+                        c.lineCodeCap = uint8_t(rest.toInt());
+                        int t = rest.indexOf(':'); // transmit pin, missing in older files
+                        if (t >= 0)
+                        {
+                            String tail = rest.substring(t + 1);
+                            c.txPin = uint8_t(tail.toInt());
+                            int e = tail.indexOf(':'); // error correction, missing in older files
+                            if (e >= 0)
+                                c.fecCap = tail.substring(e + 1).toInt() != 0;
+                        }
+                    }
+                    connections.push_back(c);
                 }
             }
             f.close();
         }
-        Serial.printf("[Web] %u connections loaded\n", physikalNode.logicalNode.connections.size());
+        Serial.printf("[Web] %u connections loaded\n", connections.size());
+        physikalNode.setConnections(connections, you);
     }
 
-    void saveConnections()
+    void saveConnections(const vector<Connection> &connections, const Address &you)
     {
         Serial.println("[Web] saveConnections");
         File f = LittleFS.open(CONN_FILE, "w");
         if (f)
         {
             // Save Own Address (first line)
-            for (size_t i = 0; i < physikalNode.logicalNode.you.size(); ++i)
+            for (size_t i = 0; i < you.size(); ++i)
             {
-                f.print(physikalNode.logicalNode.you[i]);
-                if (i + 1 < physikalNode.logicalNode.you.size())
+                f.print(you[i]);
+                if (i + 1 < you.size())
                     f.print(',');
             }
             f.println(":0");
 
             // Save Connections
-            for (auto &c : physikalNode.logicalNode.connections)
+            for (auto &c : connections)
             {
                 for (size_t i = 0; i < c.address.size(); ++i)
                 {
@@ -806,7 +950,13 @@ private:
                         f.print(',');
                 }
                 f.print(':');
-                f.println(c.pin);
+                f.print(c.pin);
+                f.print(':');
+                f.print(c.lineCodeCap);
+                f.print(':');
+                f.print(c.txPin);
+                f.print(':');
+                f.println(c.fecCap ? 1 : 0);
             }
             f.close();
             Serial.println("[Web] connections saved");